@@ -23,14 +23,25 @@
  *                - SPACE, 'P' : Pause the copy process
  *                - 'V' :        Pause after the verify process
  *
+ *              Without a keyboard, SIGUSR1 pauses the copy process and
+ *              SIGUSR2 resumes it.
+ *
+ *              The -ctl parameter creates a Unix socket accepting
+ *              commands, one per line: "pause", "resume", "stop",
+ *              "verify" to pause after the verify process, "rate N[k|m|g]"
+ *              to change the -bwlimit, 0 removing it, and "stats" for
+ *              the counters of the copy.  Each command is answered by
+ *              a line.
+ *
  *              The -del parameter transform the COPY operation into
  *              a MOVE operation.  The source (file or directory) is
  *              deleted after a successful copy to the destination.
  *
  *              The -mir parameter is used to make the destination
- *              directory a mirror of the source directory.  Files of
- *              the destination directory will be deleted if they are
- *              no longer present in the source directory.
+ *              directory a mirror of the source directory.  Files and
+ *              sub-directories of the destination directory will be
+ *              deleted if they are no longer present in the source
+ *              directory.
  *
  *              The -sync parameter considers both directories as
  *              masters.  Only the latest version of a file will be kept,
@@ -46,10 +57,125 @@
  *              Directories may be created, but no file will be copied
  *              nor deleted.
  *
+ *              The -copy parameter selects the copy engine.  With
+ *              "kernel", the default, the data is copied by the kernel
+ *              using copy_file_range(), which may be a server-side copy
+ *              on network file systems.  The pipeline is used instead
+ *              when the kernel can't copy between the two files.  With
+ *              "pipe", a reader thread and a writer thread work at the
+ *              same time through a ring of buffers, the copy being
+ *              paced by the writer only.  With "uring", up to N blocks
+ *              (-qd=N, 8 by default) are read then written by linked
+ *              io_uring requests at the same time, the pacing delaying
+ *              the next request.  The read/write loop is used when
+ *              io_uring isn't available.  With "rw", the original
+ *              read/write loop is always used.
+ *
+ *              The -bs parameter sets the block size of the read/write
+ *              loop, from 4k to 8m.  With "auto", the default, the
+ *              block size starts from the one preferred by the
+ *              destination file system and device, then is doubled
+ *              while the writes are fast, and halved when they are
+ *              slow.  The pacing is the same whatever the block size.
+ *
+ *              The -j parameter sets the number of workers copying a
+ *              directory, 1 by default.  With more workers, the
+ *              directories are read and the files are copied in
+ *              parallel, an idle worker taking the work left by the
+ *              busy ones.  A pause, from the keyboard or a rest of
+ *              the duty cycle, holds all the workers.  Each
+ *              device reads or writes up to 8 files at a time, or a
+ *              single file for a spinning disk.
+ *
+ *              The -bwlimit parameter limits the writes to each
+ *              destination device to N bytes per second, with bursts
+ *              of up to a tenth of a second by default, or of the
+ *              given size.  The -iops parameter limits them to N writes
+ *              per second.  Either one replaces the adaptive pacing,
+ *              which slows down the writes as they get slower than the
+ *              fastest one, even with -f.
+ *
+ *              The -latency parameter throttles the writes to each
+ *              destination device to keep the average latency of its
+ *              I/O under N milliseconds.  The -pressure parameter keeps
+ *              the share of the time tasks are stalled waiting for I/O
+ *              under N percent.  Four times a second, the rate of the
+ *              device is halved when over the target, and raised by
+ *              8 Mb/s otherwise, up to the -bwlimit if any.  While the
+ *              statistics are available, Linux only, the rests of the
+ *              duty cycle are skipped.
+ *
+ *              The -duty parameter sets the duty cycle of the copy.  It
+ *              works N percent of the time, 75 by default, resting
+ *              after T seconds of work, 30 by default, or after the
+ *              given size is copied, 1g by default.  The rest is
+ *              skipped when the destination device was mostly idle
+ *              during the work.  -duty=100 or -f never rest.
+ *
+ *              The -reflink parameter controls the reflink copies on
+ *              copy-on-write file systems like btrfs or XFS.  A reflink
+ *              shares the data blocks of the source, so the copy is
+ *              instant, without pacing nor verification.  With "auto",
+ *              the default, a regular copy is done when the reflink
+ *              fails.  With "always", a failed reflink is an error.
+ *              With "never", the data is always copied.
+ *
+ *              With the -resume parameter, a file of 64 Mb or more is
+ *              copied to a hidden ".name.tcpy-part" file, by the
+ *              read/write loop, then renamed once complete.  Every
+ *              64 Mb, the part file is synced and its journal records
+ *              the offset copied and the checksum state, in its
+ *              "user.tcpy.part" extended attribute or else in a
+ *              ".name.tcpy-journal" file.  An interrupted copy is kept,
+ *              and the next run with -resume continues it after
+ *              comparing the last Mb copied again.  With the
+ *              -atomic parameter, every file is copied to a part file,
+ *              synced, timed and verified before being renamed over the
+ *              destination, which stays readable during the copy
+ *              instead of being deleted first.
+ *
+ *              With -resume, a directory copy also appends a record of
+ *              every file done, with its size, modification time and
+ *              checksum, to a manifest in ~/.cache/tcpy, removed once
+ *              the copy is complete.  The records are written by
+ *              batches, after syncing the destination.  After an
+ *              interrupted copy, the next run with -resume maps the
+ *              manifest in memory and skips the files done and
+ *              unchanged since, without reading them.
+ *
+ *              The -hash parameter selects the checksum algorithm used
+ *              to compare and verify files.  "xxh64", the default, is
+ *              xxHash64.  "crc32c" uses the CPU instructions when they
+ *              are available.  "legacy" is the original tcpy checksum.
+ *
+ *              The -check parameter selects how an existing destination
+ *              file of the same size is found up to date.  "full", the
+ *              default, compares the whole content of both files.
+ *              "meta" trusts the size and the modification time, like
+ *              rsync does.  "sample" also compares the first and the
+ *              last blocks, plus N random blocks (16 by default).  With
+ *              "meta" and "sample", a file with a different
+ *              modification time is copied without being compared.
+ *
+ *              The checksum of a verified file is cached in its
+ *              "user.tcpy.checksum" extended attribute, along with its
+ *              size, modification time and inode number.  While these
+ *              are unchanged, the cached checksum is used instead of
+ *              reading the file again.  Where extended attributes
+ *              aren't available, the cache is kept in the
+ *              ~/.cache/tcpy/checksums file.  -cache=off disables it.
+ *
  *              Tested under FreeBSD 12.2.  Should be easy to port
  *              because there are not that many dependencies.
  *
- * Parameters:  [-del|-mir] [-f] [-t] <src-file>|<src-dir> [<dest-file>|<dest-dir>]
+ * Parameters:  [-del|-mir] [-f] [-t] [-copy=kernel|pipe|uring|rw] [-qd=N]
+ *              [-bs=auto|N[k|m]] [-j=N]
+ *              [-bwlimit=N[k|m|g][:burst]] [-iops=N]
+ *              [-latency=N] [-pressure=N] [-duty=N[:Ts][:size]]
+ *              [-ctl=<socket>] [-resume] [-atomic]
+ *              [-reflink=auto|always|never] [-hash=xxh64|crc32c|legacy]
+ *              [-check=full|meta|sample[:N]] [-cache=on|off]
+ *              <src-file>|<src-dir> [<dest-file>|<dest-dir>]
  *
  * Web:         https://github.com/fossette/tcpy/wiki
  *
@@ -67,17 +193,65 @@
  *
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <termios.h>
 #include <unistd.h>
+#if defined(__FreeBSD__)
+#include <sys/param.h>
+#endif
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#if defined(__NR_io_uring_setup)
+#define TCPY_HAVE_IO_URING      1
+#endif
+#if defined(SYS_getdents64)
+#define TCPY_HAVE_GETDENTS      1
+#endif
+#if defined(FS_IOC_FIEMAP)
+#define TCPY_HAVE_FIEMAP        1
+#endif
+#define TCPY_HAVE_XATTR         1
+#elif defined(__FreeBSD__)
+#include <sys/extattr.h>
+#define TCPY_HAVE_EXTATTR       1
+#define TCPY_HAVE_GETDENTS      1
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define TCPY_HAVE_CRC32C_X86    1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define TCPY_HAVE_CRC32C_ARM    1
+#endif
 
 
 
@@ -88,23 +262,127 @@
 
 // # define TCPY_DEBUG              1
 
+#if defined(__linux__) || (defined(__FreeBSD__) && __FreeBSD_version >= 1300037)
+#define TCPY_HAVE_COPY_FILE_RANGE  1
+#endif
+
+#if defined(CLOCK_MONOTONIC_FAST)
+#define TCPY_CLOCK              CLOCK_MONOTONIC_FAST
+#else
+#define TCPY_CLOCK              CLOCK_MONOTONIC
+#endif
+
 #define ERROR_TCPY              1
 #define ERROR_TCPY_USAGE        2
 #define ERROR_TCPY_MEM          3
 #define ERROR_TCPY_CIRC         4
 #define ERROR_TCPY_STOP         5
 
-#define COPYCOUNT                50
+#define DUTYWORK                 75
+#define DUTYNANO                 (ONESECINNANO * 30LL)
+#define DUTYBYTES                1073741824LL
+#define DUTYIDLE                 25
+#define SAMPLECOUNT              16
+#define CACHEXATTR               "tcpy.checksum"
+#define CACHEBUFFER              8192
+#define CACHEMAX                 1048576
+#define PARTXATTR                "tcpy.part"
+#define PARTSUFFIX               ".tcpy-part"
+#define JOURNALSUFFIX            ".tcpy-journal"
+#define MANIFESTMAGIC            0x314D535259504354ULL
+#define MANIFESTBUFFER           256
+#define MANIFESTFNV              0xCBF29CE484222325ULL
 #define LNBIGBUFFER              32768
+#define LNBLOCKMIN               4096
+#define LNBLOCKMAX               (LNBIGBUFFER * 256)
+#define BLOCKNANOMIN             2000000
+#define BLOCKNANOMAX             50000000
 #define LNCHECKSUMBUFFER         1000
+#define LNKERNELCHUNK            (LNBIGBUFFER * 32)
+#define LNCOMPAREBUFFER          (LNBIGBUFFER * 32)
+#define LNPARTMIN                (LNBIGBUFFER * 2048LL)
+#define LNPARTCHUNK              (LNBIGBUFFER * 2048LL)
+#define LNALIGN                  4096
+#define LNPIPEBUFFER             (LNBIGBUFFER * 8)
+#define PIPECOUNT                8
+#define JOBCOUNTMAX              64
+#define DEVICECOUNT              64
+#define DEVICESLOTS              8
+#define NAMESETARENA             65536
+#define NAMESETSIZE              256
+#define LNDIRBUFFER              (LNBIGBUFFER * 8)
+#define DIRLISTSIZE              256
+#define DIRSTATBATCH             64
+#define TASKCOUNT                1024
+#define QUEUEDEPTH               8
+#define QUEUEDEPTHMAX            64
 #define LNSZ                     300
+#define CTLCLIENTS               4
+#define KEYPAUSE                 256
+#define KEYRESUME                257
 #define ONESECINNANO             1000000000
+#define ONESECINMICRO            1000000
+#define THROTTLENANO             (ONESECINNANO / 4)
+#define THROTTLESTART            (LNBIGBUFFER * 2048LL)
+#define THROTTLESTEP             (LNBIGBUFFER * 256LL)
+#define THROTTLEMIN              (LNBIGBUFFER * 32LL)
 
 #define TCPY_MODE_COPY          0
 #define TCPY_MODE_DEL           1
 #define TCPY_MODE_MIRROR        2
 #define TCPY_MODE_SYNC          3
 
+#define TCPY_COPY_KERNEL        0
+#define TCPY_COPY_RW            1
+#define TCPY_COPY_PIPE          2
+#define TCPY_COPY_URING         3
+
+#define TCPY_URING_FREE         0
+#define TCPY_URING_BUSY         1
+#define TCPY_URING_DONE         2
+#define TCPY_URING_FAILED       3
+#define TCPY_URING_TIMEOUT      (~0ULL)
+
+#define TCPY_PIPE_FREE          0
+#define TCPY_PIPE_READ          1
+#define TCPY_PIPE_HASHED        2
+
+#define TCPY_PACING_OFF         0
+#define TCPY_PACING_ADAPTIVE    1
+#define TCPY_PACING_BUCKET      2
+#define TCPY_PACING_THROTTLE    3
+
+#define TCPY_REFLINK_AUTO       0
+#define TCPY_REFLINK_ALWAYS     1
+#define TCPY_REFLINK_NEVER      2
+
+#define TCPY_CHECK_FULL         0
+#define TCPY_CHECK_META         1
+#define TCPY_CHECK_SAMPLE       2
+
+#define TCPY_HASH_LEGACY        0
+#define TCPY_HASH_CRC32C        1
+#define TCPY_HASH_XXH64         2
+
+#define TCPY_TASK_FILE          0
+#define TCPY_TASK_DIR           1
+#define TCPY_TASK_PURGE         2
+
+#define XXH_PRIME64_1           0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2           0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3           0x165667B19E3779F9ULL
+#define XXH_PRIME64_4           0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5           0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, r)        (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH_ROUND(acc, lane)    (XXH_ROTL64((acc) + (lane) * XXH_PRIME64_2, \
+                                            31) * XXH_PRIME64_1)
+#define XXH_READ32(p)           ((unsigned int)(p)[0]               \
+                                 | ((unsigned int)(p)[1] << 8)      \
+                                 | ((unsigned int)(p)[2] << 16)     \
+                                 | ((unsigned int)(p)[3] << 24))
+#define XXH_READ64(p)           ((unsigned long long)XXH_READ32(p)  \
+                                 | ((unsigned long long)XXH_READ32((p) + 4) << 32))
+
 
 
 
@@ -113,6 +391,241 @@
  */
 
 typedef unsigned long long TNSEC, *PTNSEC;
+typedef unsigned long long TCHECKSUM;
+
+// Running checksum.  The legacy and CRC32C kernels only use iAcc[0].
+typedef struct
+{
+   unsigned long long   iAcc[4],
+                        iLength;
+   unsigned char        aTail[32];
+   int                  iTail;
+} TCHKSTATE, *PTCHKSTATE;
+
+// Checksum cache entry, see CacheGet.  iSeq orders the last accesses.
+typedef struct
+{
+   dev_t       iDev;
+   ino_t       iIno;
+   off_t       iSize;
+   time_t      iMtimeSec;
+   long        iMtimeNsec;
+   int         iHash;
+   TCHECKSUM   iChecksum;
+   unsigned long long   iSeq;
+} TCACHEENTRY, *PTCACHEENTRY;
+
+// Resume manifest record of a file copied or verified, the first
+// record holding MANIFESTMAGIC and the checksum algorithm.  iKey is the
+// ManifestHash of the source pathname.  See ManifestOpen.
+typedef struct
+{
+   unsigned long long   iKey;
+   long long            iSize,
+                        iMtimeSec,
+                        iMtimeNsec;
+   TCHECKSUM            iChecksum;
+} TMANIFESTENTRY, *PTMANIFESTENTRY;
+
+// Part file of a resumable copy, relative to iFdDir, and its journal:
+// the source being copied, the offset copied durably and the checksum
+// state of the bytes before it.  See PartOpen.
+typedef struct
+{
+   int         iFdDir,
+               iHash;
+   ino_t       iIno;
+   off_t       iOffset,
+               iSize;
+   time_t      iMtimeSec;
+   long        iMtimeNsec;
+   TCHKSTATE   sChecksum;
+   char        szJournal[LNSZ],
+               szName[LNSZ];
+} TPART, *PTPART;
+
+// Files being copied from or to a device, up to iLimit at a time, the
+// token buckets limiting the writes to it, and the last statistics
+// sampled by the throttle adjusting its iBwRate
+typedef struct
+{
+   int               iActive,
+                     iLimit,
+                     iRotational;
+   dev_t             iDev;
+   long long         iBwBytes,
+                     iBwRate,
+                     iBwTokens,
+                     iIoTokens,
+                     iStatIos,
+                     iStatStall,
+                     iStatTicks;
+   TNSEC             iBucketTime,
+                     iStatTime;
+} TDEVICE, *PTDEVICE;
+
+// Copy pipeline, a ring of PIPECOUNT buffers going from the reader
+// thread to the hasher (the calling thread) and then to the writer thread
+typedef struct
+{
+   int               aState[PIPECOUNT],
+                     iErr,
+                     iErrno,
+                     iFdDest,
+                     iFdSource,
+                     iStop;
+   char              *pBuffer;
+   ssize_t           aLength[PIPECOUNT];
+   PTDEVICE          pDevice;
+   pthread_mutex_t   sMutex;
+   pthread_cond_t    sCond;
+} TPIPE, *PTPIPE;
+
+#if defined(TCPY_HAVE_IO_URING)
+// io_uring instance, used without liburing
+typedef struct
+{
+   int                  iFd;
+   unsigned int         iCqMask,
+                        iSqEntries,
+                        iSqMask,
+                        iSqPending,
+                        iSqTail,
+                        *piCqHead,
+                        *piCqTail,
+                        *piSqArray,
+                        *piSqHead,
+                        *piSqTail;
+   size_t               iCqRingSize,
+                        iSqesSize,
+                        iSqRingSize;
+   void                 *pCqRing,
+                        *pSqRing;
+   struct io_uring_cqe  *pCqes;
+   struct io_uring_sqe  *pSqes;
+} TURING, *PTURING;
+
+// One block of the io_uring copy, read then written by linked requests
+typedef struct
+{
+   int         iPending,
+               iState;
+   off_t       iOffset;
+   ssize_t     iLength;
+} TURINGSLOT, *PTURINGSLOT;
+#endif // TCPY_HAVE_IO_URING
+
+// Block reader, optionally run by its own thread
+typedef struct
+{
+   int               iErrno,
+                     iFd,
+                     iGo,
+                     iHash,
+                     iStop;
+   char              *pBuffer;
+   ssize_t           iRead,
+                     iSize;
+   TCHKSTATE         sChecksum;
+   pthread_mutex_t   sMutex;
+   pthread_cond_t    sCond;
+} TREADER, *PTREADER;
+
+// Open directory shared by the tasks of its entries, closed by the
+// last one
+typedef struct
+{
+   int               iFd,
+                     iRef;
+} TDIRHANDLE, *PTDIRHANDLE;
+
+// Directory or file of the parallel walk, both paths follow the struct.
+// The entry is opened relative to its parent directories, NULL for the
+// current directory.
+typedef struct
+{
+   int               iType;
+   char              *szSource,
+                     *szDest;
+   dev_t             iDevDest,
+                     iDevSource;
+   PTDIRHANDLE       pDestDir,
+                     pSourceDir;
+} TTASK, *PTTASK;
+
+// Open addressing hash set of names, stored one after the other in
+// pArena.  A slot holds the offset + 1 of its name, 0 if it's free.
+typedef struct
+{
+   char              *pArena;
+   unsigned int      iArenaSize,
+                     iArenaUsed,
+                     iCount,
+                     iSlotCount,
+                     *pSlot;
+} TNAMESET, *PTNAMESET;
+
+// Entry of a directory, in the pArena of its TDIRLIST.  The entries are
+// sorted by iKey, the inode number or the physical offset of the data.
+typedef struct
+{
+   unsigned long long   iKey;
+   unsigned int         iName;
+   unsigned char        iType;
+} TDIRENTRY, *PTDIRENTRY;
+
+// Entries of a directory, read at once
+typedef struct
+{
+   char              *pArena;
+   unsigned int      iArenaSize,
+                     iArenaUsed,
+                     iCount,
+                     iSize;
+   PTDIRENTRY        pEntry;
+} TDIRLIST, *PTDIRLIST;
+
+#if defined(__linux__) && defined(TCPY_HAVE_GETDENTS)
+// Entry returned by getdents64(), without a libc declaration
+typedef struct
+{
+   uint64_t          d_ino;
+   int64_t           d_off;
+   unsigned short    d_reclen;
+   unsigned char     d_type;
+   char              d_name[];
+} TRAWDIRENT, *PTRAWDIRENT;
+#elif defined(TCPY_HAVE_GETDENTS)
+typedef struct dirent TRAWDIRENT, *PTRAWDIRENT;
+#endif
+
+// Parallel walk, shared by the workers
+typedef struct sWalk
+{
+   int               iErr,
+                     iMode,
+                     iPending,
+                     iQueued,
+                     iWorkerCount;
+   char              szErr[LNSZ];
+   struct sWorker    *pWorker;
+   pthread_mutex_t   sMutex;
+   pthread_cond_t    sCond;
+} TWALK, *PTWALK;
+
+// Walk worker, with its deque of tasks: the worker pushes and pops at
+// the bottom, the other workers steal at the top
+typedef struct sWorker
+{
+   int               iCount,
+                     iHead,
+                     iIndex,
+                     iSize;
+   PTTASK            *pTask;
+   PTWALK            pWalk;
+   pthread_t         sThread;
+   pthread_mutex_t   sMutex;
+} TWORKER, *PTWORKER;
 
 
 
@@ -121,16 +634,104 @@ typedef unsigned long long TNSEC, *PTNSEC;
  *  Global variable
  */
 
-int     giFaster = 0,
-        giFileCount = 0,
+int     giAtomic = 0,
+        giBlockAuto = 1,
+        giCache = 1,
+        giCacheBufferUsed = 0,
+        giCacheLines = 0,
+        giCacheLoaded = 0,
+        giCacheSize = 0,
+        giCacheUsed = 0,
+        giCheck = TCPY_CHECK_FULL,
+        giCloneFileCount = 0,
+        giCopyEngine = TCPY_COPY_KERNEL,
+        giCopyFileCount = 0,
+        giDutyWork = DUTYWORK,
+        giFaster = 0,
+        giGbDone = 0,
+        giHash = TCPY_HASH_XXH64,
+        giJobCount = 1,
+        giLatencyTarget = 0,
+        giPacing = TCPY_PACING_ADAPTIVE,
         giPauseAfterVerif = 0,
-        giTestRun = 0;
-char    *gpBigBuffer = NULL,
-        gszErr[LNSZ];
-TNSEC   giNanoFastest = 0,
+        giPressureTarget = 0,
+        giQueueDepth = QUEUEDEPTH,
+        giReflink = TCPY_REFLINK_AUTO,
+        giResume = 0,
+        giSampleCount = SAMPLECOUNT,
+        giTestRun = 0,
+        giThrottled = 0;
+ssize_t giBlockSize = LNBIGBUFFER;
+char    gszCacheBuffer[CACHEBUFFER],
+        gszCachePath[LNSZ];
+TNSEC   giDutyNano = DUTYNANO,
+        giDutyStart = 0,
+        giDutyStatTime = 0,
+        giNanoFastest = 0,
         giNanoPrev = 0;
 ssize_t giCopyByteCount = 0,
         giTotalByteCount = 0;
+long long giBwBurst = 0,
+          giBwLimit = 0,
+          giDutyBytes = DUTYBYTES,
+          giDutyStatBusy = 0,
+          giIopsLimit = 0;
+
+// Each walk worker has its own buffer and error message
+__thread char  *gpBigBuffer = NULL,
+               gszErr[LNSZ];
+
+// gsMutex protects the counters, the pacing, the block size and the
+// checksum cache.  gsKeyboardMutex protects the pause and the rests,
+// the paused workers waiting on gsKeyboardCond.
+pthread_mutex_t   gsCacheMutex = PTHREAD_MUTEX_INITIALIZER,
+                  gsKeyboardMutex = PTHREAD_MUTEX_INITIALIZER,
+                  gsManifestMutex = PTHREAD_MUTEX_INITIALIZER,
+                  gsMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t    gsKeyboardCond = PTHREAD_COND_INITIALIZER;
+
+// Set under gsKeyboardMutex, checked by the workers without it
+atomic_int        giPaused = 0,
+                  giResting = 0,
+                  giStop = 0;
+
+// Signals to the keyboard thread, and the end of the control thread
+int               giControlFd = -1,
+                  giControlPipe[2] = {-1, -1},
+                  giKeyboardPipe[2] = {-1, -1};
+
+// Devices used by the walk workers, protected by gsMutex
+int               giDeviceCount = 0;
+TDEVICE           gsDevice[DEVICECOUNT];
+pthread_cond_t    gsDeviceCond = PTHREAD_COND_INITIALIZER;
+
+int          *gpCacheIndex = NULL;
+
+// Resume manifest: the records of the previous run mapped in memory
+// and their index, the records of this run buffered, under gsMutex
+int             giManifestCount = 0,
+                giManifestDestFd = -1,
+                giManifestFd = -1,
+                giManifestSize = 0,
+                giManifestUsed = 0,
+                *gpManifestIndex = NULL;
+char            gszManifestPath[LNSZ];
+PTMANIFESTENTRY gpManifest = NULL;
+TMANIFESTENTRY  gsManifestBuffer[MANIFESTBUFFER];
+unsigned int giCrc32cTable[8][256];
+PTCACHEENTRY gpCache = NULL;
+
+// Sidecar database: the last access, and the size of the file as read
+// then appended by this process, -1 when unknown
+unsigned long long   giCacheSeq = 0;
+off_t                giCacheFileSize = 0;
+void    (*gpfnChecksumAdd)(const char *, ssize_t, PTCHKSTATE) = NULL;
+
+// Destination device of the duty cycle statistics
+dev_t    giDutyDev = 0;
+
+// Destination device of the automatic block size
+__dev_t  giBlockDev = 0;
 
 // Circular directory prevention!  No source directory can match this!
 __dev_t  giSt_dev = 0;      /* inode's device */
@@ -143,627 +744,6220 @@ ino_t    giSt_ino = 0;      /* inode's number */
 ///////////////////////////////////////////////////////////////////////////
 
 /*
- *  ChecksumAdd
+ *  DeviceQueueRead
  *
- *  The initial seed value of checksums is 0.
+ *  Read a value of the block device queue, -1 if it's unknown.  Only
+ *  Linux exposes it, in sysfs.
  */
 
-void
-ChecksumAdd(char *pBigBuffer, ssize_t iSize, unsigned long *pChecksum)
+long long
+DeviceQueueRead(dev_t iDev, const char *szName)
 {
-   unsigned long iMsb;
-   
-   
-   while (iSize)
-   {
-      iMsb = *pChecksum & 0x80000000;
-      *pChecksum ^= ( ((unsigned long)(*pBigBuffer)) & 0xFF );
-      *pChecksum <<= 1;
-      if (iMsb)
-         *pChecksum |= 1;
+   long long   iValue = -1;
+#if defined(__linux__)
+   int         i;
+   FILE        *pFile;
+   char        sz[LNSZ];
 
-      iSize--;
-      pBigBuffer++;
+
+   // A partition has no queue, its disk has
+   for (i = 0 ; i < 2 ; i++)
+   {
+      sprintf(sz, "/sys/dev/block/%u:%u/%squeue/%s", major(iDev),
+                  minor(iDev), i ? "../" : "", szName);
+      pFile = fopen(sz, "r");
+      if (pFile)
+      {
+         if (fscanf(pFile, "%lld", &iValue) != 1)
+            iValue = -1;
+         fclose(pFile);
+         i = 2;
+      }
    }
+#endif
+
+   return(iValue);
 }
 
 
 
 
 /*
- *  EchoPrint
+ *  DeviceStatRead
+ *
+ *  Read the number of I/O completed by the block device, the
+ *  milliseconds they took, both reads and writes, and the milliseconds
+ *  the device was busy.  Returns -1 if they are unknown.  Only Linux
+ *  exposes them, in sysfs.
  */
 
-void
-EchoPrint(const char *pSz)
+int
+DeviceStatRead(dev_t iDev,     long long *piIos, long long *piTicks,
+               long long *piBusy)
 {
-   printf("%s\n", pSz);
+   int         iErr = -1;
+#if defined(__linux__)
+   long long   a[10];
+   FILE        *pFile;
+   char        sz[LNSZ];
+
+
+   sprintf(sz, "/sys/dev/block/%u:%u/stat", major(iDev), minor(iDev));
+   pFile = fopen(sz, "r");
+   if (pFile)
+   {
+      // Reads then writes: completed, merged, sectors and milliseconds,
+      // then the I/O in flight and the busy milliseconds
+      if (fscanf(pFile, "%lld %lld %lld %lld %lld %lld %lld %lld %lld"
+                 " %lld", a, a + 1, a + 2, a + 3, a + 4, a + 5, a + 6,
+                 a + 7, a + 8, a + 9) == 10)
+      {
+         *piIos = a[0] + a[4];
+         *piTicks = a[3] + a[7];
+         *piBusy = a[9];
+         iErr = 0;
+      }
+      fclose(pFile);
+   }
+#endif
+
+   return(iErr);
 }
 
 
 
 
 /*
- *  KeyboardCheck
+ *  BigBufferAlloc
+ *
+ *  Allocate the gpBigBuffer of a thread, large enough for any block
+ *  size.  The samples are always compared by LNBIGBUFFER blocks.
  */
 
-int
-KeyboardCheck(int iInducedPause)
+char *
+BigBufferAlloc(void)
 {
-   int      i,
-            iErr = 0,
-            iPause;
-   fd_set   sFdSet;
-   struct timeval sTime = {0, 0};
+   return((char *)malloc(giBlockAuto ? LNBLOCKMAX
+                         : giBlockSize > LNBIGBUFFER ? giBlockSize
+                         : LNBIGBUFFER));
+}
 
 
-   iPause = iInducedPause;
-   if (iPause)
-      EchoPrint("Pause...");
 
-   do
-   {
-      FD_ZERO(&sFdSet);
-      FD_SET(STDIN_FILENO, &sFdSet);
-      if (select(STDIN_FILENO + 1, &sFdSet, NULL, NULL, &sTime) > 0)
-      {
-         i = getchar();
-         if (feof(stdin) || ferror(stdin))
-            clearerr(stdin);
-         if (i == ' ' || i == 'p' || i == 'P')           // SPACE
-         {
-            iPause = !iPause;
-            if (iPause)
-               EchoPrint("Pause...");
-            else
-               EchoPrint("Resume...");
-         }
-         else if (i == 27 || i == 'q' || i == 'Q')       // ESC
-            iErr = ERROR_TCPY_STOP;
-         else if (i == 'v' || i == 'V')
-         {
-            giPauseAfterVerif = 1;
-            EchoPrint("Pause Requested!");
-         }
 
-         if (iPause)
-            usleep(3000);  // Pause 0.3 sec.
-      }
-   }
-   while (!iErr && iPause);
-   
-   return(iErr);                            
+/*
+ *  BlockSizeGet
+ */
+
+ssize_t
+BlockSizeGet(void)
+{
+   ssize_t iSize;
+
+
+   pthread_mutex_lock(&gsMutex);
+   iSize = giBlockSize;
+   pthread_mutex_unlock(&gsMutex);
+
+   return(iSize);
 }
 
 
 
 
 /*
- *  NanoTime
+ *  BlockSizeInit
+ *
+ *  With the automatic block size, start from the block size preferred
+ *  by the destination file system and by its device, when the
+ *  destination device changes.  Otherwise, the block size learned by
+ *  BlockSizeUpdate is kept.
  */
 
-TNSEC
-NanoTime(void)
+void
+BlockSizeInit(int iFd)
 {
-   TNSEC iTime;
-   struct timespec sTime;
+   ssize_t     iSize;
+   struct stat sStat;
+   long long   iOptimal;
 
 
-   if (clock_gettime(CLOCK_REALTIME_FAST,     &sTime))
+   pthread_mutex_lock(&gsMutex);
+   if (giBlockAuto && !fstat(iFd,     &sStat)
+       && (sStat.st_dev != giBlockDev || !giBlockDev))
    {
-      iTime = sTime.tv_sec * ONESECINNANO;
-      iTime += sTime.tv_nsec;
+      giBlockDev = sStat.st_dev;
+      iSize = LNBIGBUFFER;
+      if (sStat.st_blksize > iSize)
+         iSize = sStat.st_blksize;
+
+      iOptimal = DeviceQueueRead(sStat.st_dev, "optimal_io_size");
+      if (iOptimal > iSize)
+         iSize = iOptimal;
+
+      if (iSize > LNBLOCKMAX)
+         iSize = LNBLOCKMAX;
+      giBlockSize = iSize - iSize % LNBLOCKMIN;
    }
-   else
-      iTime = 0;
-   
-   return (iTime);
+   pthread_mutex_unlock(&gsMutex);
 }
 
 
 
 
 /*
- *  StringShortner
+ *  BlockSizeUpdate
+ *
+ *  With the automatic block size, double the block size when a full
+ *  block was written in less than BLOCKNANOMIN, halve it when it took
+ *  more than BLOCKNANOMAX.
  */
 
 void
-StringShortner(const char *pLongSz, int iMax,     char *pShortSz)
+BlockSizeUpdate(TNSEC iNano, ssize_t iSize)
 {
-   int i;
-
-
-   i = strlen(pLongSz);
-   if (i < iMax)
-      strcpy(pShortSz, pLongSz);
-   else
+   pthread_mutex_lock(&gsMutex);
+   if (giBlockAuto && iSize == giBlockSize)
    {
-      if (i <= iMax + 5)      // Borderline for the dots separator?
-         iMax -= 5;
-
-      iMax /= 2;
-      strncpy(pShortSz, pLongSz, iMax);
-      pShortSz[iMax] = 0;
-      strcat(pShortSz, " ... ");
-      strcat(pShortSz, pLongSz + i - iMax);
+      if (iNano < BLOCKNANOMIN && iSize * 2 <= LNBLOCKMAX)
+         giBlockSize = iSize * 2;
+      else if (iNano > BLOCKNANOMAX && iSize / 2 >= LNBLOCKMIN)
+         giBlockSize = iSize / 2;
    }
+   pthread_mutex_unlock(&gsMutex);
 }
 
 
 
 
-///////////////////////////////////////////////////////////////////////////
-//    Level 2 : Directory Functions                                      //
-///////////////////////////////////////////////////////////////////////////
-
 /*
- *  DirectoryExist
+ *  ByteCountAdd
+ *
+ *  Account for iSize bytes written.
  */
 
-int
-DirectoryExist(const char *szPathname,     struct stat *pStat)
+void
+ByteCountAdd(ssize_t iSize)
 {
-   int i;
-   struct stat sStat, *pStat2;
+   pthread_mutex_lock(&gsMutex);
+   giCopyByteCount += iSize;
+   giTotalByteCount += iSize;
+   pthread_mutex_unlock(&gsMutex);
+}
 
 
-   if (pStat)
-      pStat2 = pStat;
-   else
-      pStat2 = &sStat;
 
-   i = !stat(szPathname,     pStat2);
-   if (i)
-      i = (pStat2->st_mode & S_IFDIR);
 
-#ifdef TCPY_DEBUG
-   printf("\n%d = DirectoryExist(%s), st_mode=0%o\n", i, szPathname, (unsigned int)(pStat2->st_mode));
-#endif // TCPY_DEBUG
+/*
+ *  ChecksumAdd
+ *
+ *  Add iSize bytes to the checksum, using the kernel selected by
+ *  ChecksumSelect.
+ */
 
-   return(i);
+void
+ChecksumAdd(const char *pBigBuffer, ssize_t iSize,     PTCHKSTATE pState)
+{
+   gpfnChecksumAdd(pBigBuffer, iSize,     pState);
 }
 
 
 
 
 /*
- *  DirectoryValidate
+ *  ChecksumAddCrc32c
+ *
+ *  Portable CRC32C (Castagnoli) kernel, slicing 8 bytes at a time.
  */
 
-int
-DirectoryValidate(const char *szPathname,     struct stat *pStat)
+void
+ChecksumAddCrc32c(const char *pBigBuffer, ssize_t iSize,     PTCHKSTATE pState)
 {
-   int   i,
-         iErr = 0;
-   char  sz[LNSZ],
-         sz2[LNSZ],
-         *pSzDirname;
-   struct stat sStat, *pStat2;
+   unsigned int         iCrc,
+                        iHigh;
+   const unsigned char  *p;
 
 
-   i = strlen(szPathname);
-   if (i)
+   iCrc = (unsigned int)pState->iAcc[0];
+   p = (const unsigned char *)pBigBuffer;
+   while (iSize >= 8)
    {
-      if (pStat)
-         pStat2 = pStat;
-      else
-         pStat2 = &sStat;
-
-      if (!DirectoryExist(szPathname,     pStat2))
-      {
-         pSzDirname = (char *)malloc(i + 10);
-         if (pSzDirname)
-         {
-            strcpy(pSzDirname, szPathname);
-            if (pSzDirname[i - 1] == '/')    // Slash the ending slash
-            {
-               i--;
-               pSzDirname[i] = 0;
-            }
-
-            // Make sure that the parent directory exists
-            while (i && pSzDirname[i] != '/')
-               i--;
-            if (pSzDirname[i] == '/')
-            {
-               if (i)
-               {
-                  pSzDirname[i] = 0;
-                  iErr = DirectoryValidate(pSzDirname,     pStat2);
-                  pSzDirname[i] = '/';
-               }
-               else
-                  stat("/",     pStat2);
-            }
-            else
-               stat(".",     pStat2);
-
-            if (!iErr)
-            {
-               StringShortner(pSzDirname, LNSZ - 40,     sz);
-               sprintf(sz2, "mkdir(%s, Mode=0%o)", sz,
-                            (unsigned int)pStat2->st_mode);
-               EchoPrint(sz2);
-               if (mkdir(pSzDirname, pStat2->st_mode))
-               {
-                  iErr = ERROR_TCPY;
-                  sprintf(gszErr, "Could Not Create %s (errno=%d)",
-                                  sz, errno);
-               }
-               else
-                  stat(pSzDirname,     pStat2);
-            }
-      
-            free(pSzDirname);
-         }
-         else
-            iErr = ERROR_TCPY_MEM;
-      }
+      iCrc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+      iHigh = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+      iCrc = giCrc32cTable[7][iCrc & 0xFF]
+             ^ giCrc32cTable[6][(iCrc >> 8) & 0xFF]
+             ^ giCrc32cTable[5][(iCrc >> 16) & 0xFF]
+             ^ giCrc32cTable[4][iCrc >> 24]
+             ^ giCrc32cTable[3][iHigh & 0xFF]
+             ^ giCrc32cTable[2][(iHigh >> 8) & 0xFF]
+             ^ giCrc32cTable[1][(iHigh >> 16) & 0xFF]
+             ^ giCrc32cTable[0][iHigh >> 24];
+      p += 8;
+      iSize -= 8;
    }
-   else if (pStat)
-      // Not throwing an error but making sure there is no side effect
-      memset(pStat, 0, sizeof(struct stat));
-
-   return(iErr);                            
+   while (iSize)
+   {
+      iCrc = giCrc32cTable[0][(iCrc ^ *p) & 0xFF] ^ (iCrc >> 8);
+      p++;
+      iSize--;
+   }
+   pState->iAcc[0] = iCrc;
+   pState->iLength += p - (const unsigned char *)pBigBuffer;
 }
 
 
 
 
+#if defined(TCPY_HAVE_CRC32C_ARM)
 /*
- *  FilenameChecksum
+ *  ChecksumAddCrc32cArm
+ *
+ *  CRC32C kernel using the ARMv8 CRC instructions.
  */
 
-int
-FilenameChecksum(const char *szFilename,     unsigned long *piChecksum)
+void
+ChecksumAddCrc32cArm(const char *pBigBuffer, ssize_t iSize,
+                                                    PTCHKSTATE pState)
 {
-   int      iErr = 0,
+   unsigned int         iCrc;
+   unsigned long long   i;
+   const unsigned char  *p;
+
+
+   iCrc = (unsigned int)pState->iAcc[0];
+   p = (const unsigned char *)pBigBuffer;
+   pState->iLength += iSize;
+   while (iSize && ((uintptr_t)p & 7))
+   {
+      iCrc = __crc32cb(iCrc, *p++);
+      iSize--;
+   }
+   while (iSize >= 8)
+   {
+      memcpy(&i, p, 8);
+      iCrc = __crc32cd(iCrc, i);
+      p += 8;
+      iSize -= 8;
+   }
+   while (iSize)
+   {
+      iCrc = __crc32cb(iCrc, *p++);
+      iSize--;
+   }
+   pState->iAcc[0] = iCrc;
+}
+#endif // TCPY_HAVE_CRC32C_ARM
+
+
+
+
+#if defined(TCPY_HAVE_CRC32C_X86)
+/*
+ *  ChecksumAddCrc32cX86
+ *
+ *  CRC32C kernel using the SSE4.2 crc32 instruction.
+ */
+
+__attribute__((target("sse4.2")))
+void
+ChecksumAddCrc32cX86(const char *pBigBuffer, ssize_t iSize,
+                                                    PTCHKSTATE pState)
+{
+   unsigned long long   i,
+                        iCrc;
+   const unsigned char  *p;
+
+
+   iCrc = pState->iAcc[0];
+   p = (const unsigned char *)pBigBuffer;
+   pState->iLength += iSize;
+   while (iSize && ((uintptr_t)p & 7))
+   {
+      iCrc = _mm_crc32_u8((unsigned int)iCrc, *p++);
+      iSize--;
+   }
+   while (iSize >= 8)
+   {
+      memcpy(&i, p, 8);
+      iCrc = _mm_crc32_u64(iCrc, i);
+      p += 8;
+      iSize -= 8;
+   }
+   while (iSize)
+   {
+      iCrc = _mm_crc32_u8((unsigned int)iCrc, *p++);
+      iSize--;
+   }
+   pState->iAcc[0] = iCrc;
+}
+#endif // TCPY_HAVE_CRC32C_X86
+
+
+
+
+/*
+ *  ChecksumAddLegacy
+ *
+ *  The original tcpy rotating XOR checksum, kept for compatibility.
+ */
+
+void
+ChecksumAddLegacy(const char *pBigBuffer, ssize_t iSize,
+                                                    PTCHKSTATE pState)
+{
+   unsigned long iChecksum,
+                 iMsb;
+   
+   
+   iChecksum = (unsigned long)pState->iAcc[0];
+   pState->iLength += iSize;
+   while (iSize)
+   {
+      iMsb = iChecksum & 0x80000000;
+      iChecksum ^= ( ((unsigned long)(*pBigBuffer)) & 0xFF );
+      iChecksum <<= 1;
+      if (iMsb)
+         iChecksum |= 1;
+
+      iSize--;
+      pBigBuffer++;
+   }
+   pState->iAcc[0] = iChecksum;
+}
+
+
+
+
+/*
+ *  ChecksumAddXxh64
+ *
+ *  xxHash64 kernel, seed 0.  Bytes are buffered in aTail until a full
+ *  32 bytes stripe is available for the four accumulators.
+ */
+
+void
+ChecksumAddXxh64(const char *pBigBuffer, ssize_t iSize,     PTCHKSTATE pState)
+{
+   int                  i;
+   unsigned long long   iLane;
+   const unsigned char  *p;
+
+
+   p = (const unsigned char *)pBigBuffer;
+   pState->iLength += iSize;
+
+   if (pState->iTail + iSize < 32)
+   {
+      memcpy(pState->aTail + pState->iTail, p, iSize);
+      pState->iTail += iSize;
+      iSize = 0;
+   }
+   else if (pState->iTail)
+   {
+      i = 32 - pState->iTail;
+      memcpy(pState->aTail + pState->iTail, p, i);
+      p += i;
+      iSize -= i;
+      for (i = 0 ; i < 4 ; i++)
+      {
+         iLane = XXH_READ64(pState->aTail + i * 8);
+         pState->iAcc[i] = XXH_ROUND(pState->iAcc[i], iLane);
+      }
+      pState->iTail = 0;
+   }
+
+   while (iSize >= 32)
+   {
+      for (i = 0 ; i < 4 ; i++)
+      {
+         iLane = XXH_READ64(p + i * 8);
+         pState->iAcc[i] = XXH_ROUND(pState->iAcc[i], iLane);
+      }
+      p += 32;
+      iSize -= 32;
+   }
+
+   if (iSize)
+   {
+      memcpy(pState->aTail, p, iSize);
+      pState->iTail = iSize;
+   }
+}
+
+
+
+
+/*
+ *  ChecksumInit
+ */
+
+void
+ChecksumInit(PTCHKSTATE pState)
+{
+   memset(pState, 0, sizeof(TCHKSTATE));
+   if (giHash == TCPY_HASH_CRC32C)
+      pState->iAcc[0] = 0xFFFFFFFF;
+   else if (giHash == TCPY_HASH_XXH64)
+   {
+      pState->iAcc[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+      pState->iAcc[1] = XXH_PRIME64_2;
+      pState->iAcc[2] = 0;
+      pState->iAcc[3] = -XXH_PRIME64_1;
+   }
+}
+
+
+
+
+/*
+ *  ChecksumSelect
+ *
+ *  Select the checksum algorithm by name, and its fastest kernel for
+ *  the running CPU.  Returns 0 if the name is unknown.
+ */
+
+int
+ChecksumSelect(const char *szName)
+{
+   int            i,
+                  iFound = 1,
+                  j;
+   unsigned int   iCrc;
+
+
+   if (!strcmp(szName, "legacy"))
+   {
+      giHash = TCPY_HASH_LEGACY;
+      gpfnChecksumAdd = ChecksumAddLegacy;
+   }
+   else if (!strcmp(szName, "crc32c"))
+   {
+      giHash = TCPY_HASH_CRC32C;
+      gpfnChecksumAdd = ChecksumAddCrc32c;
+#if defined(TCPY_HAVE_CRC32C_X86)
+      if (__builtin_cpu_supports("sse4.2"))
+         gpfnChecksumAdd = ChecksumAddCrc32cX86;
+#elif defined(TCPY_HAVE_CRC32C_ARM)
+      gpfnChecksumAdd = ChecksumAddCrc32cArm;
+#endif
+
+      for (i = 0 ; i < 256 ; i++)
+      {
+         iCrc = i;
+         for (j = 0 ; j < 8 ; j++)
+            iCrc = (iCrc & 1) ? (iCrc >> 1) ^ 0x82F63B78 : iCrc >> 1;
+         giCrc32cTable[0][i] = iCrc;
+      }
+      for (j = 1 ; j < 8 ; j++)
+         for (i = 0 ; i < 256 ; i++)
+         {
+            iCrc = giCrc32cTable[j - 1][i];
+            giCrc32cTable[j][i] = giCrc32cTable[0][iCrc & 0xFF] ^ (iCrc >> 8);
+         }
+   }
+   else if (!strcmp(szName, "xxh64"))
+   {
+      giHash = TCPY_HASH_XXH64;
+      gpfnChecksumAdd = ChecksumAddXxh64;
+   }
+   else
+      iFound = 0;
+
+   return(iFound);
+}
+
+
+
+
+/*
+ *  ChecksumValue
+ *
+ *  Final value of the checksum.  The state is left unchanged, so more
+ *  bytes can still be added.
+ */
+
+TCHECKSUM
+ChecksumValue(PTCHKSTATE pState)
+{
+   int                  i;
+   unsigned long long   iHash;
+   const unsigned char  *p;
+
+
+   if (giHash == TCPY_HASH_CRC32C)
+      iHash = pState->iAcc[0] ^ 0xFFFFFFFF;
+   else if (giHash == TCPY_HASH_XXH64)
+   {
+      if (pState->iLength >= 32)
+      {
+         iHash = XXH_ROTL64(pState->iAcc[0], 1)
+                 + XXH_ROTL64(pState->iAcc[1], 7)
+                 + XXH_ROTL64(pState->iAcc[2], 12)
+                 + XXH_ROTL64(pState->iAcc[3], 18);
+         for (i = 0 ; i < 4 ; i++)
+         {
+            iHash ^= XXH_ROUND(0, pState->iAcc[i]);
+            iHash = iHash * XXH_PRIME64_1 + XXH_PRIME64_4;
+         }
+      }
+      else
+         iHash = XXH_PRIME64_5;
+      iHash += pState->iLength;
+
+      p = pState->aTail;
+      i = pState->iTail;
+      while (i >= 8)
+      {
+         iHash ^= XXH_ROUND(0, XXH_READ64(p));
+         iHash = XXH_ROTL64(iHash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+         p += 8;
+         i -= 8;
+      }
+      if (i >= 4)
+      {
+         iHash ^= (unsigned long long)XXH_READ32(p) * XXH_PRIME64_1;
+         iHash = XXH_ROTL64(iHash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+         p += 4;
+         i -= 4;
+      }
+      while (i)
+      {
+         iHash ^= (*p) * XXH_PRIME64_5;
+         iHash = XXH_ROTL64(iHash, 11) * XXH_PRIME64_1;
+         p++;
+         i--;
+      }
+
+      iHash ^= iHash >> 33;
+      iHash *= XXH_PRIME64_2;
+      iHash ^= iHash >> 29;
+      iHash *= XXH_PRIME64_3;
+      iHash ^= iHash >> 32;
+   }
+   else
+      iHash = pState->iAcc[0];
+
+   return(iHash);
+}
+
+
+
+
+/*
+ *  DeviceSlot
+ *
+ *  Entry of the device in gsDevice, added on first use.  A spinning
+ *  disk copies one file at a time, other devices DEVICESLOTS files.
+ *  Returns NULL when the table is full, the device isn't limited then.
+ *  gsMutex must be held.
+ */
+
+PTDEVICE
+DeviceSlot(dev_t iDev)
+{
+   int      i;
+   PTDEVICE pDevice = NULL;
+
+
+   for (i = 0 ; i < giDeviceCount && !pDevice ; i++)
+      if (gsDevice[i].iDev == iDev)
+         pDevice = gsDevice + i;
+
+   if (!pDevice && giDeviceCount < DEVICECOUNT)
+   {
+      pDevice = gsDevice + giDeviceCount;
+      giDeviceCount++;
+      pDevice->iDev = iDev;
+      pDevice->iActive = 0;
+      pDevice->iBucketTime = 0;
+      pDevice->iBwBytes = 0;
+      pDevice->iBwRate = giBwLimit;
+      if (giPacing == TCPY_PACING_THROTTLE
+          && (!giBwLimit || giBwLimit > THROTTLESTART))
+         pDevice->iBwRate = THROTTLESTART;
+      pDevice->iStatTime = 0;
+      pDevice->iRotational = (DeviceQueueRead(iDev, "rotational") == 1);
+      pDevice->iLimit = pDevice->iRotational ? 1 : DEVICESLOTS;
+   }
+
+   return(pDevice);
+}
+
+
+
+
+/*
+ *  DeviceAcquire
+ *
+ *  Wait until a file can be copied from iDevSource to iDevDest, then
+ *  count it on both devices.  A copy within a device counts once.
+ */
+
+void
+DeviceAcquire(dev_t iDevSource, dev_t iDevDest)
+{
+   PTDEVICE pDest,
+            pSource;
+
+
+   pthread_mutex_lock(&gsMutex);
+   pSource = DeviceSlot(iDevSource);
+   pDest = DeviceSlot(iDevDest);
+   if (pDest == pSource)
+      pDest = NULL;
+   while ((pSource && pSource->iActive >= pSource->iLimit)
+          || (pDest && pDest->iActive >= pDest->iLimit))
+      pthread_cond_wait(&gsDeviceCond, &gsMutex);
+   if (pSource)
+      pSource->iActive++;
+   if (pDest)
+      pDest->iActive++;
+   pthread_mutex_unlock(&gsMutex);
+}
+
+
+
+
+/*
+ *  DeviceRelease
+ */
+
+void
+DeviceRelease(dev_t iDevSource, dev_t iDevDest)
+{
+   PTDEVICE pDest,
+            pSource;
+
+
+   pthread_mutex_lock(&gsMutex);
+   pSource = DeviceSlot(iDevSource);
+   pDest = DeviceSlot(iDevDest);
+   if (pDest == pSource)
+      pDest = NULL;
+   if (pSource)
+      pSource->iActive--;
+   if (pDest)
+      pDest->iActive--;
+   pthread_cond_broadcast(&gsDeviceCond);
+   pthread_mutex_unlock(&gsMutex);
+}
+
+
+
+
+/*
+ *  DirHandleFd
+ *
+ *  Descriptor of the pDir directory, AT_FDCWD when pDir is NULL.
+ */
+
+int
+DirHandleFd(PTDIRHANDLE pDir)
+{
+   return(pDir ? pDir->iFd : AT_FDCWD);
+}
+
+
+
+
+/*
+ *  DirHandleHold
+ *
+ *  One more reference to pDir, which may be NULL.
+ */
+
+PTDIRHANDLE
+DirHandleHold(PTDIRHANDLE pDir)
+{
+   if (pDir)
+   {
+      pthread_mutex_lock(&gsMutex);
+      pDir->iRef++;
+      pthread_mutex_unlock(&gsMutex);
+   }
+
+   return(pDir);
+}
+
+
+
+
+/*
+ *  DirHandleNew
+ *
+ *  Handle of the iFd open directory, holding one reference.  iFd is
+ *  closed on failure.
+ */
+
+PTDIRHANDLE
+DirHandleNew(int iFd)
+{
+   PTDIRHANDLE pDir;
+
+
+   pDir = (PTDIRHANDLE)malloc(sizeof(TDIRHANDLE));
+   if (pDir)
+   {
+      pDir->iFd = iFd;
+      pDir->iRef = 1;
+   }
+   else
+      close(iFd);
+
+   return(pDir);
+}
+
+
+
+
+/*
+ *  DirHandleRelease
+ *
+ *  Drop a reference to pDir, which may be NULL.  The directory is closed
+ *  with the last one.
+ */
+
+void
+DirHandleRelease(PTDIRHANDLE pDir)
+{
+   int i = 1;
+
+
+   if (pDir)
+   {
+      pthread_mutex_lock(&gsMutex);
+      i = --pDir->iRef;
+      pthread_mutex_unlock(&gsMutex);
+   }
+   if (!i)
+   {
+      close(pDir->iFd);
+      free(pDir);
+   }
+}
+
+
+
+
+/*
+ *  EchoPrint
+ */
+
+void
+EchoPrint(const char *pSz)
+{
+   printf("%s\n", pSz);
+}
+
+
+
+
+/*
+ *  KeyboardCheck
+ *
+ *  Once a worker is stopped by the user, the other workers are
+ *  stopped too.  A paused or resting copy waits here.  The flags are
+ *  set by the KeyboardThread, checking them is free.
+ */
+
+int
+KeyboardCheck(int iInducedPause)
+{
+   int iErr = 0;
+
+
+   if (iInducedPause || giPaused || giResting)
+   {
+      pthread_mutex_lock(&gsKeyboardMutex);
+      if (iInducedPause)
+      {
+         giPaused = 1;
+         EchoPrint("Pause...");
+      }
+      while ((giPaused || giResting) && !giStop)
+         pthread_cond_wait(&gsKeyboardCond, &gsKeyboardMutex);
+      pthread_mutex_unlock(&gsKeyboardMutex);
+   }
+
+   if (giStop)
+      iErr = ERROR_TCPY_STOP;
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  KeyboardKey
+ *
+ *  Act on the i key, or on the KEYPAUSE and KEYRESUME signals, out of
+ *  the range of the keys.
+ */
+
+void
+KeyboardKey(int i)
+{
+   pthread_mutex_lock(&gsKeyboardMutex);
+   if (i == ' ' || i == 'p' || i == 'P'                 // SPACE
+       || (i == KEYPAUSE && !giPaused) || (i == KEYRESUME && giPaused))
+   {
+      giPaused = !giPaused;
+      if (giPaused)
+         EchoPrint("Pause...");
+      else
+         EchoPrint("Resume...");
+   }
+   else if (i == 27 || i == 'q' || i == 'Q')            // ESC
+      giStop = 1;
+   else if (i == 'v' || i == 'V')
+   {
+      pthread_mutex_lock(&gsMutex);
+      giPauseAfterVerif = 1;
+      pthread_mutex_unlock(&gsMutex);
+      EchoPrint("Pause Requested!");
+   }
+   pthread_cond_broadcast(&gsKeyboardCond);
+   pthread_mutex_unlock(&gsKeyboardMutex);
+}
+
+
+
+
+/*
+ *  KeyboardRest
+ *
+ *  Hold all the workers for iRest microseconds, unless the copy is
+ *  stopped.
+ */
+
+void
+KeyboardRest(ssize_t iRest)
+{
+   struct timespec sTime;
+
+
+   clock_gettime(CLOCK_REALTIME,     &sTime);
+   sTime.tv_sec += iRest / ONESECINMICRO;
+   sTime.tv_nsec += (iRest % ONESECINMICRO) * 1000;
+   if (sTime.tv_nsec >= ONESECINNANO)
+   {
+      sTime.tv_sec++;
+      sTime.tv_nsec -= ONESECINNANO;
+   }
+
+   pthread_mutex_lock(&gsKeyboardMutex);
+   giResting++;
+   while (!giStop && pthread_cond_timedwait(&gsKeyboardCond,
+                                            &gsKeyboardMutex,
+                                            &sTime) != ETIMEDOUT)
+      ;
+   giResting--;
+   pthread_cond_broadcast(&gsKeyboardCond);
+   pthread_mutex_unlock(&gsKeyboardMutex);
+}
+
+
+
+
+/*
+ *  KeyboardSignal
+ *
+ *  SIGUSR1 pauses the copy, SIGUSR2 resumes it.  The signal number is
+ *  passed to the KeyboardThread through giKeyboardPipe.
+ */
+
+void
+KeyboardSignal(int iSignal)
+{
+   int   iErrno;
+   char  c;
+
+
+   iErrno = errno;
+   c = (char)iSignal;
+   write(giKeyboardPipe[1], &c, 1);
+   errno = iErrno;
+}
+
+
+
+
+/*
+ *  KeyboardThread
+ *
+ *  Read the keyboard and the signals, out of the copy.  A closed or
+ *  redirected stdin is ignored once it's at its end.  A null byte in
+ *  giKeyboardPipe ends the thread.
+ */
+
+void *
+KeyboardThread(void *pArg)
+{
+   int            iRun = 1;
+   char           c;
+   sigset_t       sSet;
+   struct pollfd  sPoll[2];
+
+
+   // Only this thread handles the signals
+   sigemptyset(&sSet);
+   sigaddset(&sSet, SIGUSR1);
+   sigaddset(&sSet, SIGUSR2);
+   pthread_sigmask(SIG_UNBLOCK, &sSet, NULL);
+
+   sPoll[0].fd = giKeyboardPipe[0];
+   sPoll[0].events = POLLIN;
+   sPoll[1].fd = STDIN_FILENO;
+   sPoll[1].events = POLLIN;
+   while (iRun)
+   {
+      if (poll(sPoll, 2, -1) > 0)
+      {
+         if (sPoll[0].revents && read(sPoll[0].fd, &c, 1) == 1)
+         {
+            if (c)
+               KeyboardKey(c == SIGUSR1 ? KEYPAUSE : KEYRESUME);
+            else
+               iRun = 0;
+         }
+         if (sPoll[1].revents)
+         {
+            if (read(sPoll[1].fd, &c, 1) == 1)
+               KeyboardKey((unsigned char)c);
+            else
+               sPoll[1].fd = -1;
+         }
+      }
+   }
+
+   return(pArg);
+}
+
+
+
+
+/*
+ *  NameSetHash
+ *
+ *  FNV-1a hash of a name.
+ */
+
+unsigned int
+NameSetHash(const char *szName)
+{
+   unsigned int iHash = 2166136261U;
+
+
+   while (*szName)
+   {
+      iHash ^= (unsigned char)*szName;
+      iHash *= 16777619U;
+      szName++;
+   }
+
+   return(iHash);
+}
+
+
+
+
+/*
+ *  NameSetAdd
+ *
+ *  Add a name to the set, which grows as needed.  The names of a
+ *  directory being unique, duplicates aren't checked.
+ */
+
+int
+NameSetAdd(PTNAMESET pSet, const char *szName)
+{
+   int            iErr = 0;
+   unsigned int   i,
+                  iLn,
+                  iSize,
+                  j,
+                  *pSlot;
+   char           *pArena;
+
+
+   // Keep at least half of the slots free
+   if ((pSet->iCount + 1) * 2 > pSet->iSlotCount)
+   {
+      iSize = pSet->iSlotCount ? pSet->iSlotCount * 2 : NAMESETSIZE;
+      pSlot = (unsigned int *)calloc(iSize, sizeof(unsigned int));
+      if (pSlot)
+      {
+         for (i = 0 ; i < pSet->iSlotCount ; i++)
+            if (pSet->pSlot[i])
+            {
+               j = NameSetHash(pSet->pArena + pSet->pSlot[i] - 1)
+                   & (iSize - 1);
+               while (pSlot[j])
+                  j = (j + 1) & (iSize - 1);
+               pSlot[j] = pSet->pSlot[i];
+            }
+         if (pSet->pSlot)
+            free(pSet->pSlot);
+         pSet->pSlot = pSlot;
+         pSet->iSlotCount = iSize;
+      }
+      else
+         iErr = ERROR_TCPY_MEM;
+   }
+
+   iLn = strlen(szName) + 1;
+   if (!iErr && pSet->iArenaUsed + iLn > pSet->iArenaSize)
+   {
+      iSize = pSet->iArenaSize ? pSet->iArenaSize * 2 : NAMESETARENA;
+      if (iSize <= pSet->iArenaSize)
+         pArena = NULL;
+      else
+         pArena = (char *)realloc(pSet->pArena, iSize);
+      if (pArena)
+      {
+         pSet->pArena = pArena;
+         pSet->iArenaSize = iSize;
+      }
+      else
+         iErr = ERROR_TCPY_MEM;
+   }
+
+   if (!iErr)
+   {
+      j = NameSetHash(szName) & (pSet->iSlotCount - 1);
+      while (pSet->pSlot[j])
+         j = (j + 1) & (pSet->iSlotCount - 1);
+      memcpy(pSet->pArena + pSet->iArenaUsed, szName, iLn);
+      pSet->pSlot[j] = pSet->iArenaUsed + 1;
+      pSet->iArenaUsed += iLn;
+      pSet->iCount++;
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  NameSetFind
+ */
+
+int
+NameSetFind(PTNAMESET pSet, const char *szName)
+{
+   int            iFound = 0;
+   unsigned int   j;
+
+
+   if (pSet->iCount)
+   {
+      j = NameSetHash(szName) & (pSet->iSlotCount - 1);
+      while (pSet->pSlot[j] && !iFound)
+      {
+         iFound = !strcmp(pSet->pArena + pSet->pSlot[j] - 1, szName);
+         j = (j + 1) & (pSet->iSlotCount - 1);
+      }
+   }
+
+   return(iFound);
+}
+
+
+
+
+/*
+ *  NameSetNext
+ *
+ *  Name following szName in the set, in insertion order, the first
+ *  name when szName is NULL.  Returns NULL after the last name.
+ */
+
+const char *
+NameSetNext(PTNAMESET pSet, const char *szName)
+{
+   if (szName)
+      szName += strlen(szName) + 1;
+   else
+      szName = pSet->pArena;
+   if (szName >= pSet->pArena + pSet->iArenaUsed)
+      szName = NULL;
+
+   return(szName);
+}
+
+
+
+
+/*
+ *  NameSetFree
+ */
+
+void
+NameSetFree(PTNAMESET pSet)
+{
+   if (pSet->pArena)
+      free(pSet->pArena);
+   if (pSet->pSlot)
+      free(pSet->pSlot);
+   memset(pSet, 0, sizeof(TNAMESET));
+}
+
+
+
+
+/*
+ *  NanoTime
+ */
+
+TNSEC
+NanoTime(void)
+{
+   TNSEC iTime;
+   struct timespec sTime;
+
+
+   if (!clock_gettime(TCPY_CLOCK,     &sTime))
+   {
+      iTime = sTime.tv_sec * ONESECINNANO;
+      iTime += sTime.tv_nsec;
+   }
+   else
+      iTime = 0;
+   
+   return (iTime);
+}
+
+
+
+
+/*
+ *  DutyRest
+ *
+ *  Rest due after a file is copied to the iFdDir directory, in
+ *  microseconds.  A work period lasts up to giDutyNano, or until
+ *  giDutyBytes are copied, then the rest keeps the work to giDutyWork
+ *  percent of the time.  The rest is skipped when the destination device
+ *  was busy less than DUTYIDLE percent of the period.  A worker ending
+ *  a file during the rest of another one waits until its end.  gsMutex
+ *  must not be held.
+ */
+
+ssize_t
+DutyRest(int iFdDir)
+{
+   int         iSample;
+   ssize_t     iRest = 0;
+   long long   iBusy = -1,
+               iElapsed,
+               iIos,
+               iTicks;
+   dev_t       iDev = 0;
+   TNSEC       iNano;
+   struct stat sStat;
+
+
+   // The device statistics are read out of gsMutex, only at the start
+   // and at the end of a period
+   pthread_mutex_lock(&gsMutex);
+   iElapsed = (long long)(NanoTime() - giDutyStart);
+   iSample = (iElapsed >= 0 && (!giDutyStatTime
+                                || iElapsed >= (long long)giDutyNano
+                                || giCopyByteCount >= giDutyBytes));
+   pthread_mutex_unlock(&gsMutex);
+   if (iSample && !fstat(iFdDir,     &sStat))
+   {
+      iDev = sStat.st_dev;
+      if (DeviceStatRead(iDev,     &iIos, &iTicks, &iBusy))
+         iBusy = -1;
+   }
+
+   pthread_mutex_lock(&gsMutex);
+   iNano = NanoTime();
+   iElapsed = (long long)(iNano - giDutyStart);
+   if (iElapsed < 0)
+   {
+      // Another worker is resting, the rest of the period is shared
+      iRest = -iElapsed / 1000;
+   }
+   else if (!giDutyStatTime)
+   {
+      // First copy of the period, its device statistics are kept
+      giDutyStatTime = iNano;
+      giDutyStatBusy = iBusy;
+      giDutyDev = iDev;
+   }
+   else if (iElapsed >= (long long)giDutyNano
+            || giCopyByteCount >= giDutyBytes)
+   {
+      iRest = iElapsed / 1000 * (100 - giDutyWork) / giDutyWork;
+
+      // An idle device doesn't need the rest
+      if (giDutyStatBusy >= 0 && iBusy >= 0 && iDev == giDutyDev
+          && iNano > giDutyStatTime
+          && (iBusy - giDutyStatBusy) * 100000000
+             < (long long)(iNano - giDutyStatTime) * DUTYIDLE)
+         iRest = 0;
+
+      giCopyByteCount = 0;
+      giDutyStart = iNano + iRest * 1000;
+      giDutyStatTime = 0;
+   }
+   pthread_mutex_unlock(&gsMutex);
+
+   return(iRest);
+}
+
+
+
+
+/*
+ *  PressureRead
+ *
+ *  Read the total microseconds some tasks were stalled waiting for I/O,
+ *  -1 if it's unknown.  Only Linux exposes it, as the pressure stall
+ *  information.
+ */
+
+long long
+PressureRead(void)
+{
+   long long   iTotal = -1;
+#if defined(__linux__)
+   FILE        *pFile;
+
+
+   pFile = fopen("/proc/pressure/io", "r");
+   if (pFile)
+   {
+      if (fscanf(pFile, "some avg10=%*f avg60=%*f avg300=%*f total=%lld",
+                 &iTotal) != 1)
+         iTotal = -1;
+      fclose(pFile);
+   }
+#endif
+
+   return(iTotal);
+}
+
+
+
+
+/*
+ *  PacingBucket
+ *
+ *  Token bucket delay before writing iSize bytes to the pDevice device.
+ *  Its buckets are refilled with iBwRate bytes and giIopsLimit writes
+ *  per second, up to their burst size, an idle second filling them.
+ *  The tokens are taken right away, a bucket in debt delaying the next
+ *  writes.  gsMutex must be held.
+ */
+
+TNSEC
+PacingBucket(PTDEVICE pDevice, ssize_t iSize)
+{
+   long long   iBurst,
+               iBwBurst,
+               iMicro;
+   TNSEC       iNano,
+               iNanoBw = 0,
+               iNanoIo = 0;
+
+
+   // The throttle changes the rate, its burst follows
+   iBwBurst = giBwBurst;
+   if (giPacing == TCPY_PACING_THROTTLE)
+   {
+      iBwBurst = pDevice->iBwRate / 10;
+      if (iBwBurst < LNBIGBUFFER)
+         iBwBurst = LNBIGBUFFER;
+   }
+
+   // The writes are counted in millionths
+   iBurst = (giIopsLimit / 10 + 1) * ONESECINMICRO;
+   iNano = NanoTime();
+   iMicro = (iNano - pDevice->iBucketTime) / 1000;
+   if (!pDevice->iBucketTime || iMicro >= ONESECINMICRO)
+   {
+      pDevice->iBwTokens = iBwBurst;
+      pDevice->iIoTokens = iBurst;
+      pDevice->iBucketTime = iNano;
+   }
+   else
+   {
+      // The remainder of the microsecond is kept for the next refill
+      pDevice->iBwTokens += iMicro * pDevice->iBwRate / ONESECINMICRO;
+      if (pDevice->iBwTokens > iBwBurst)
+         pDevice->iBwTokens = iBwBurst;
+      pDevice->iIoTokens += iMicro * giIopsLimit;
+      if (pDevice->iIoTokens > iBurst)
+         pDevice->iIoTokens = iBurst;
+      pDevice->iBucketTime += iMicro * 1000;
+   }
+
+   pDevice->iBwBytes += iSize;
+   if (pDevice->iBwRate)
+   {
+      pDevice->iBwTokens -= iSize;
+      if (pDevice->iBwTokens < 0)
+         iNanoBw = -pDevice->iBwTokens * ONESECINMICRO
+                   / pDevice->iBwRate * 1000;
+   }
+   if (giIopsLimit)
+   {
+      pDevice->iIoTokens -= ONESECINMICRO;
+      if (pDevice->iIoTokens < 0)
+         iNanoIo = -pDevice->iIoTokens / giIopsLimit * 1000;
+   }
+
+   return(iNanoBw > iNanoIo ? iNanoBw : iNanoIo);
+}
+
+
+
+
+/*
+ *  PacingThrottle
+ *
+ *  Adjust the iBwRate of the pDevice device every THROTTLENANO, to hold
+ *  the latency of its I/O under giLatencyTarget milliseconds and the I/O
+ *  pressure under giPressureTarget percent.  Over a target, the rate is
+ *  halved, otherwise it grows by THROTTLESTEP while it's used.  Without
+ *  statistics, the rate falls back to giBwLimit.  gsMutex must be held.
+ */
+
+void
+PacingThrottle(PTDEVICE pDevice)
+{
+   int         iInput = 0,
+               iOver = 0;
+   long long   iBusy,
+               iDelta,
+               iElapsed,
+               iIos = -1,
+               iStall = -1,
+               iTicks = -1;
+   TNSEC       iNano;
+
+
+   iNano = NanoTime();
+   iElapsed = (long long)(iNano - pDevice->iStatTime);
+   if (!pDevice->iStatTime || iElapsed >= THROTTLENANO)
+   {
+      if (giLatencyTarget)
+         DeviceStatRead(pDevice->iDev,     &iIos, &iTicks, &iBusy);
+      if (giPressureTarget)
+         iStall = PressureRead();
+
+      if (pDevice->iStatTime)
+      {
+         // Average latency of the I/O completed since the last
+         // sample.  A counter reset doesn't count as an overload.
+         if (iIos >= 0 && pDevice->iStatIos >= 0)
+         {
+            iInput = 1;
+            iDelta = iIos - pDevice->iStatIos;
+            if (iTicks - pDevice->iStatTicks
+                > giLatencyTarget * (iDelta > 0 ? iDelta : 0))
+               iOver = 1;
+         }
+
+         // Share of the time some tasks were stalled waiting for I/O
+         if (iStall >= 0 && pDevice->iStatStall >= 0)
+         {
+            iInput = 1;
+            iDelta = iStall - pDevice->iStatStall;
+            if ((iDelta > 0 ? iDelta : 0) * 100000
+                > iElapsed * giPressureTarget)
+               iOver = 1;
+         }
+
+         if (iInput)
+         {
+            giThrottled = 1;
+            if (!pDevice->iBwRate)
+               pDevice->iBwRate = THROTTLESTART;
+            if (iOver)
+               pDevice->iBwRate /= 2;
+            else if (pDevice->iBwBytes * 2 * ONESECINMICRO
+                     / (iElapsed / 1000) >= pDevice->iBwRate)
+               pDevice->iBwRate += THROTTLESTEP;
+            if (pDevice->iBwRate < THROTTLEMIN)
+               pDevice->iBwRate = THROTTLEMIN;
+            if (giBwLimit && pDevice->iBwRate > giBwLimit)
+               pDevice->iBwRate = giBwLimit;
+         }
+         else
+            pDevice->iBwRate = giBwLimit;
+      }
+
+      pDevice->iBwBytes = 0;
+      pDevice->iStatIos = iIos;
+      pDevice->iStatStall = iStall;
+      pDevice->iStatTicks = iTicks;
+      pDevice->iStatTime = iNano;
+   }
+}
+
+
+
+
+/*
+ *  PacingDelay
+ *
+ *  Slowdown needed before writing iSize bytes to the pDevice device,
+ *  according to the giPacing policy.  The adaptive delays are kept
+ *  relative to a LNBIGBUFFER block, whatever the block size.  The token
+ *  buckets are those of the destination device, none if pDevice is
+ *  NULL.
+ */
+
+TNSEC
+PacingDelay(PTDEVICE pDevice, ssize_t iSize)
+{
+   TNSEC iNano = 0;
+
+
+   if (giPacing == TCPY_PACING_ADAPTIVE)
+   {
+      pthread_mutex_lock(&gsMutex);
+      iNano = giNanoPrev - giNanoFastest;
+      pthread_mutex_unlock(&gsMutex);
+      if (iSize != LNBIGBUFFER)
+         iNano = (iNano * iSize) / LNBIGBUFFER;
+   }
+   else if (giPacing >= TCPY_PACING_BUCKET && pDevice)
+   {
+      pthread_mutex_lock(&gsMutex);
+      if (giPacing == TCPY_PACING_THROTTLE)
+         PacingThrottle(pDevice);
+      iNano = PacingBucket(pDevice, iSize);
+      pthread_mutex_unlock(&gsMutex);
+   }
+
+   return(iNano);
+}
+
+
+
+
+/*
+ *  PacingDevice
+ *
+ *  Device of the iFd destination file, for its token buckets.  NULL
+ *  when they aren't used.
+ */
+
+PTDEVICE
+PacingDevice(int iFd)
+{
+   PTDEVICE    pDevice = NULL;
+   struct stat sStat;
+
+
+   if (giPacing >= TCPY_PACING_BUCKET && !fstat(iFd,     &sStat))
+   {
+      pthread_mutex_lock(&gsMutex);
+      pDevice = DeviceSlot(sStat.st_dev);
+      pthread_mutex_unlock(&gsMutex);
+   }
+
+   return(pDevice);
+}
+
+
+
+
+/*
+ *  PacingSleep
+ *
+ *  Slowdown before writing iSize bytes to the pDevice device, if
+ *  needed.
+ */
+
+void
+PacingSleep(PTDEVICE pDevice, ssize_t iSize)
+{
+   TNSEC iNano;
+   struct timespec sTime;
+
+
+   iNano = PacingDelay(pDevice, iSize);
+   if (iNano)
+   {
+      sTime.tv_sec = iNano / ONESECINNANO;
+      sTime.tv_nsec = iNano % ONESECINNANO;
+      nanosleep(&sTime, NULL);
+   }
+}
+
+
+
+
+/*
+ *  PacingUpdate
+ *
+ *  Account for the iNano duration of a write of iSize bytes.
+ */
+
+void
+PacingUpdate(TNSEC iNano, ssize_t iSize)
+{
+   if (iSize != LNBIGBUFFER)
+      iNano = (iNano * LNBIGBUFFER) / iSize;
+   pthread_mutex_lock(&gsMutex);
+   giNanoPrev = iNano;
+   if (!giNanoFastest || giNanoPrev < giNanoFastest)
+      giNanoFastest = giNanoPrev;
+   pthread_mutex_unlock(&gsMutex);
+}
+
+
+
+
+/*
+ *  PartName
+ *
+ *  Name of the hidden szSuffix file of szPathname, in the same
+ *  directory: ".name" followed by szSuffix.  Returns 1 if it would be
+ *  too long.
+ */
+
+int
+PartName(const char *szPathname, const char *szSuffix,     char *szPart)
+{
+   int         iErr = 1;
+   const char  *pSz;
+
+
+   pSz = strrchr(szPathname, '/');
+   pSz = pSz ? pSz + 1 : szPathname;
+   if (strlen(szPathname) + strlen(szSuffix) + 1 < LNSZ
+       && strlen(pSz) + strlen(szSuffix) + 1 <= NAME_MAX)
+   {
+      sprintf(szPart, "%.*s.%s%s", (int)(pSz - szPathname), szPathname,
+                                   pSz, szSuffix);
+      iErr = 0;
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  PartSource
+ *
+ *  Whether szName is the part file or the journal of a resumable copy,
+ *  the name of its file in szSource.
+ */
+
+int
+PartSource(const char *szName,     char *szSource)
+{
+   int      iFound = 0;
+   size_t   i;
+
+
+   i = strlen(szName);
+   if (*szName == '.' && i < LNSZ)
+   {
+      if (i > strlen(PARTSUFFIX) + 1
+          && !strcmp(szName + i - strlen(PARTSUFFIX), PARTSUFFIX))
+         i -= strlen(PARTSUFFIX);
+      else if (i > strlen(JOURNALSUFFIX) + 1
+               && !strcmp(szName + i - strlen(JOURNALSUFFIX), JOURNALSUFFIX))
+         i -= strlen(JOURNALSUFFIX);
+      else
+         i = 0;
+      if (i)
+      {
+         strncpy(szSource, szName + 1, i - 1);
+         szSource[i - 1] = 0;
+         iFound = 1;
+      }
+   }
+
+   return(iFound);
+}
+
+
+
+
+/*
+ *  PathAt
+ *
+ *  Pathname of szPathname relative to its iFdDir parent directory, i.e.
+ *  its last component, ending slash included.  The whole szPathname for
+ *  AT_FDCWD.
+ */
+
+const char *
+PathAt(int iFdDir, const char *szPathname)
+{
+   size_t i = 0;
+
+
+   if (iFdDir != AT_FDCWD)
+   {
+      i = strlen(szPathname);
+      if (i && szPathname[i - 1] == '/')
+         i--;
+      while (i && szPathname[i - 1] != '/')
+         i--;
+   }
+
+   return(szPathname + i);
+}
+
+
+
+
+/*
+ *  ReadBlock
+ *
+ *  Fill the buffer, unless the end of the file is reached.  Returns the
+ *  number of bytes read, or -1 with errno set.
+ */
+
+ssize_t
+ReadBlock(int iFd, char *pBuffer, ssize_t iSize)
+{
+   ssize_t  i,
+            iRead = 0;
+
+
+   do
+   {
+      i = read(iFd, pBuffer + iRead, iSize - iRead);
+      if (i > 0)
+         iRead += i;
+      else if (i < 0 && errno != EINTR)
+         iRead = -1;
+   }
+   while ((i > 0 || (i < 0 && errno == EINTR)) && iRead < iSize);
+
+   return(iRead);
+}
+
+
+
+
+/*
+ *  ReaderRead
+ *
+ *  Fill the buffer with the next block, unless the end of the file is
+ *  reached, and add it to the reader checksum if requested.
+ */
+
+void
+ReaderRead(PTREADER pReader)
+{
+   pReader->iRead = ReadBlock(pReader->iFd, pReader->pBuffer,
+                                            pReader->iSize);
+   if (pReader->iRead < 0)
+      pReader->iErrno = errno;
+   else if (pReader->iRead && pReader->iHash)
+      ChecksumAdd(pReader->pBuffer, pReader->iRead,     &pReader->sChecksum);
+}
+
+
+
+
+/*
+ *  ReaderStart
+ *
+ *  Ask the reader thread for the next block.
+ */
+
+void
+ReaderStart(PTREADER pReader)
+{
+   pthread_mutex_lock(&pReader->sMutex);
+   pReader->iGo = 1;
+   pthread_cond_signal(&pReader->sCond);
+   pthread_mutex_unlock(&pReader->sMutex);
+}
+
+
+
+
+/*
+ *  ReaderThread
+ */
+
+void *
+ReaderThread(void *pArg)
+{
+   PTREADER pReader = (PTREADER)pArg;
+
+
+   pthread_mutex_lock(&pReader->sMutex);
+   while (!pReader->iStop)
+   {
+      if (pReader->iGo)
+      {
+         pthread_mutex_unlock(&pReader->sMutex);
+         ReaderRead(pReader);
+         pthread_mutex_lock(&pReader->sMutex);
+         pReader->iGo = 0;
+         pthread_cond_signal(&pReader->sCond);
+      }
+      else
+         pthread_cond_wait(&pReader->sCond, &pReader->sMutex);
+   }
+   pthread_mutex_unlock(&pReader->sMutex);
+
+   return(NULL);
+}
+
+
+
+
+/*
+ *  ReaderWait
+ *
+ *  Wait for the block requested by ReaderStart.
+ */
+
+void
+ReaderWait(PTREADER pReader)
+{
+   pthread_mutex_lock(&pReader->sMutex);
+   while (pReader->iGo)
+      pthread_cond_wait(&pReader->sCond, &pReader->sMutex);
+   pthread_mutex_unlock(&pReader->sMutex);
+}
+
+
+
+
+/*
+ *  SizeParse
+ *
+ *  Number of szSize, with an optional k, m or g suffix.  *ppSzEnd is
+ *  set after it.
+ */
+
+long long
+SizeParse(const char *szSize,     char **ppSzEnd)
+{
+   long long iSize;
+   char        *pSz;
+
+
+   iSize = strtoll(szSize, &pSz, 10);
+   if (*pSz == 'k' || *pSz == 'K')
+   {
+      iSize *= 1024;
+      pSz++;
+   }
+   else if (*pSz == 'm' || *pSz == 'M')
+   {
+      iSize *= 1024 * 1024;
+      pSz++;
+   }
+   else if (*pSz == 'g' || *pSz == 'G')
+   {
+      iSize *= 1024 * 1024 * 1024;
+      pSz++;
+   }
+   *ppSzEnd = pSz;
+
+   return(iSize);
+}
+
+
+
+
+/*
+ *  StringShortner
+ */
+
+void
+StringShortner(const char *pLongSz, int iMax,     char *pShortSz)
+{
+   int i;
+
+
+   i = strlen(pLongSz);
+   if (i < iMax)
+      strcpy(pShortSz, pLongSz);
+   else
+   {
+      if (i <= iMax + 5)      // Borderline for the dots separator?
+         iMax -= 5;
+
+      iMax /= 2;
+      strncpy(pShortSz, pLongSz, iMax);
+      pShortSz[iMax] = 0;
+      strcat(pShortSz, " ... ");
+      strcat(pShortSz, pLongSz + i - iMax);
+   }
+}
+
+
+
+
+/*
+ *  DirListAdd
+ *
+ *  Add an entry to the list, which grows as needed.  "." and ".." are
+ *  skipped.
+ */
+
+int
+DirListAdd(PTDIRLIST pList, const char *szName, unsigned char iType,
+                            unsigned long long iIno)
+{
+   int            iErr = 0;
+   unsigned int   iLn,
+                  iSize;
+   char           *pArena;
+   PTDIRENTRY     pEntry;
+
+
+   if (strcmp(szName, ".") && strcmp(szName, ".."))
+   {
+      if (pList->iCount == pList->iSize)
+      {
+         iSize = pList->iSize ? pList->iSize * 2 : DIRLISTSIZE;
+         pEntry = (PTDIRENTRY)realloc(pList->pEntry,
+                                      iSize * sizeof(TDIRENTRY));
+         if (pEntry)
+         {
+            pList->pEntry = pEntry;
+            pList->iSize = iSize;
+         }
+         else
+            iErr = ERROR_TCPY_MEM;
+      }
+
+      iLn = strlen(szName) + 1;
+      if (!iErr && pList->iArenaUsed + iLn > pList->iArenaSize)
+      {
+         iSize = pList->iArenaSize ? pList->iArenaSize : NAMESETARENA;
+         while (pList->iArenaUsed + iLn > iSize)
+            iSize *= 2;
+         pArena = (char *)realloc(pList->pArena, iSize);
+         if (pArena)
+         {
+            pList->pArena = pArena;
+            pList->iArenaSize = iSize;
+         }
+         else
+            iErr = ERROR_TCPY_MEM;
+      }
+
+      if (!iErr)
+      {
+         pEntry = pList->pEntry + pList->iCount;
+         pEntry->iKey = iIno;
+         pEntry->iName = pList->iArenaUsed;
+         pEntry->iType = iType;
+         memcpy(pList->pArena + pList->iArenaUsed, szName, iLn);
+         pList->iArenaUsed += iLn;
+         pList->iCount++;
+      }
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  DirListCompare
+ *
+ *  qsort() order of the entries.
+ */
+
+int
+DirListCompare(const void *p1, const void *p2)
+{
+   unsigned long long   iKey1 = ((PTDIRENTRY)p1)->iKey,
+                        iKey2 = ((PTDIRENTRY)p2)->iKey;
+
+
+   return(iKey1 < iKey2 ? -1 : iKey1 > iKey2);
+}
+
+
+
+
+/*
+ *  DirListFree
+ */
+
+void
+DirListFree(PTDIRLIST pList)
+{
+   if (pList->pArena)
+      free(pList->pArena);
+   if (pList->pEntry)
+      free(pList->pEntry);
+   memset(pList, 0, sizeof(TDIRLIST));
+}
+
+
+
+
+/*
+ *  DirListRead
+ *
+ *  Read all the entries of the iFd open directory, szDir.  The kernel
+ *  fills a large buffer with many entries per call where getdents64()
+ *  or getdirentries() is available, readdir() is used otherwise.
+ */
+
+int
+DirListRead(PTDIRLIST pList, int iFd, const char *szDir)
+{
+   int            iErr = 0;
+   char           sz[LNSZ];
+#if defined(TCPY_HAVE_GETDENTS)
+   ssize_t        i,
+                  iRead;
+   char           *pBuffer;
+   PTRAWDIRENT    pDirEntry;
+#if defined(__FreeBSD__)
+   off_t          iBase;
+#endif
+#else
+   DIR            *pDir = NULL;
+   struct dirent  *pDirEntry;
+#endif
+
+
+   pList->iArenaUsed = pList->iCount = 0;
+#if defined(TCPY_HAVE_GETDENTS)
+   pBuffer = (char *)malloc(LNDIRBUFFER);
+   if (pBuffer)
+   {
+      do
+      {
+#if defined(__linux__)
+         iRead = syscall(SYS_getdents64, iFd, pBuffer, LNDIRBUFFER);
+#else
+         iRead = getdirentries(iFd, pBuffer, LNDIRBUFFER, &iBase);
+#endif
+         for (i = 0 ; i < iRead && !iErr ; i += pDirEntry->d_reclen)
+         {
+            pDirEntry = (PTRAWDIRENT)(pBuffer + i);
+            iErr = DirListAdd(pList, pDirEntry->d_name, pDirEntry->d_type,
+                                     pDirEntry->d_ino);
+         }
+      }
+      while (iRead > 0 && !iErr);
+
+      if (iRead < 0)
+      {
+         iErr = ERROR_TCPY;
+         StringShortner(szDir, LNSZ - 50,     sz);
+         sprintf(gszErr, "Could Not Read %s (errno=%d)", sz, errno);
+      }
+      free(pBuffer);
+   }
+   else
+      iErr = ERROR_TCPY_MEM;
+#else
+   // The directory stream gets its own descriptor
+   iFd = dup(iFd);
+   if (iFd >= 0)
+   {
+      pDir = fdopendir(iFd);
+      if (!pDir)
+         close(iFd);
+   }
+   if (pDir)
+   {
+      while (!iErr && (pDirEntry = readdir(pDir)))
+         iErr = DirListAdd(pList, pDirEntry->d_name, pDirEntry->d_type,
+                                  pDirEntry->d_ino);
+      closedir(pDir);
+   }
+   else
+   {
+      iErr = ERROR_TCPY;
+      StringShortner(szDir, LNSZ - 50,     sz);
+      sprintf(gszErr, "Could Not Read %s (errno=%d)", sz, errno);
+   }
+#endif
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  DirListSort
+ *
+ *  Sort the entries of the iFd open directory by inode number, so that
+ *  the files are read in about the order of their data on the disk.
+ *  On a spinning disk, the physical offset of the first extent is used
+ *  instead, where FIEMAP is available.
+ */
+
+void
+DirListSort(PTDIRLIST pList, int iFd)
+{
+#if defined(TCPY_HAVE_FIEMAP)
+   int            iFdFile,
+                  iPhysical = 0;
+   unsigned int   i;
+   PTDEVICE       pDevice;
+   struct stat    sStat;
+   struct
+   {
+      struct fiemap        sMap;
+      struct fiemap_extent sExtent;
+   } sFiemap;
+
+
+   if (!fstat(iFd,     &sStat))
+   {
+      pthread_mutex_lock(&gsMutex);
+      pDevice = DeviceSlot(sStat.st_dev);
+      iPhysical = (pDevice && pDevice->iRotational);
+      pthread_mutex_unlock(&gsMutex);
+   }
+
+   // The entries without data come first
+   for (i = 0 ; i < pList->iCount && iPhysical ; i++)
+   {
+      pList->pEntry[i].iKey = 0;
+      if (pList->pEntry[i].iType == DT_REG)
+      {
+         iFdFile = openat(iFd, pList->pArena + pList->pEntry[i].iName,
+                          O_RDONLY|O_NOFOLLOW);
+         if (iFdFile >= 0)
+         {
+            memset(&sFiemap, 0, sizeof(sFiemap));
+            sFiemap.sMap.fm_length = FIEMAP_MAX_OFFSET;
+            sFiemap.sMap.fm_extent_count = 1;
+            if (!ioctl(iFdFile, FS_IOC_FIEMAP, &sFiemap)
+                && sFiemap.sMap.fm_mapped_extents)
+               pList->pEntry[i].iKey = sFiemap.sExtent.fe_physical;
+            close(iFdFile);
+         }
+      }
+   }
+#endif
+
+   qsort(pList->pEntry, pList->iCount, sizeof(TDIRENTRY), DirListCompare);
+}
+
+
+
+
+/*
+ *  TaskFree
+ */
+
+void
+TaskFree(PTTASK pTask)
+{
+   DirHandleRelease(pTask->pDestDir);
+   DirHandleRelease(pTask->pSourceDir);
+   free(pTask);
+}
+
+
+
+
+/*
+ *  TaskNew
+ *
+ *  Task of the parallel walk, for the szName entry of both directories,
+ *  holding a reference to their handles.  The paths of a directory end
+ *  with a slash.
+ */
+
+PTTASK
+TaskNew(int iType, PTDIRHANDLE pSourceDir, PTDIRHANDLE pDestDir,
+                   const char *szSourceDir, const char *szDestDir,
+                   const char *szName)
+{
+   size_t   iLnDest,
+            iLnSource;
+   PTTASK   pTask;
+
+
+   iLnSource = strlen(szSourceDir) + strlen(szName);
+   iLnDest = strlen(szDestDir) + strlen(szName);
+   pTask = (PTTASK)malloc(sizeof(TTASK) + iLnSource + iLnDest + 4);
+   if (pTask)
+   {
+      pTask->iType = iType;
+      pTask->iDevDest = pTask->iDevSource = 0;
+      pTask->pDestDir = DirHandleHold(pDestDir);
+      pTask->pSourceDir = DirHandleHold(pSourceDir);
+      pTask->szSource = (char *)(pTask + 1);
+      pTask->szDest = pTask->szSource + iLnSource + 2;
+      strcpy(pTask->szSource, szSourceDir);
+      strcat(pTask->szSource, szName);
+      strcpy(pTask->szDest, szDestDir);
+      strcat(pTask->szDest, szName);
+      if (iType != TCPY_TASK_FILE && iLnSource
+          && pTask->szSource[iLnSource - 1] != '/')
+         strcat(pTask->szSource, "/");
+      if (iType != TCPY_TASK_FILE && iLnDest
+          && pTask->szDest[iLnDest - 1] != '/')
+         strcat(pTask->szDest, "/");
+   }
+
+   return(pTask);
+}
+
+
+
+
+#if defined(TCPY_HAVE_IO_URING)
+/*
+ *  UringClose
+ */
+
+void
+UringClose(PTURING pRing)
+{
+   if (pRing->pSqes)
+      munmap(pRing->pSqes, pRing->iSqesSize);
+   if (pRing->pCqRing && pRing->pCqRing != pRing->pSqRing)
+      munmap(pRing->pCqRing, pRing->iCqRingSize);
+   if (pRing->pSqRing)
+      munmap(pRing->pSqRing, pRing->iSqRingSize);
+   if (pRing->iFd >= 0)
+      close(pRing->iFd);
+   memset(pRing, 0, sizeof(TURING));
+   pRing->iFd = -1;
+}
+
+
+
+
+/*
+ *  UringCqe
+ *
+ *  Next completion, or NULL.  UringCqeSeen releases it.
+ */
+
+struct io_uring_cqe *
+UringCqe(PTURING pRing)
+{
+   unsigned int         iHead;
+   struct io_uring_cqe  *pCqe = NULL;
+
+
+   iHead = *pRing->piCqHead;
+   if (iHead != __atomic_load_n(pRing->piCqTail, __ATOMIC_ACQUIRE))
+      pCqe = pRing->pCqes + (iHead & pRing->iCqMask);
+
+   return(pCqe);
+}
+
+
+
+
+/*
+ *  UringCqeSeen
+ */
+
+void
+UringCqeSeen(PTURING pRing)
+{
+   __atomic_store_n(pRing->piCqHead, *pRing->piCqHead + 1, __ATOMIC_RELEASE);
+}
+
+
+
+
+/*
+ *  UringEnter
+ *
+ *  Submit the pending requests, and wait for iWait completions.
+ *  Returns 0, or the errno.
+ */
+
+int
+UringEnter(PTURING pRing, unsigned int iWait)
+{
+   int iErrno = 0;
+
+
+   __atomic_store_n(pRing->piSqTail, pRing->iSqTail, __ATOMIC_RELEASE);
+   if (syscall(__NR_io_uring_enter, pRing->iFd, pRing->iSqPending, iWait,
+               iWait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+      iErrno = errno;
+   else
+      pRing->iSqPending = 0;
+
+   return(iErrno);
+}
+
+
+
+
+/*
+ *  UringOpen
+ *
+ *  Setup an io_uring instance of iEntries submission entries.
+ *  Returns 0, or the errno.
+ */
+
+int
+UringOpen(PTURING pRing, unsigned int iEntries)
+{
+   int                     iErrno = 0;
+   char                    *p;
+   struct io_uring_params  sParams;
+
+
+   memset(pRing, 0, sizeof(TURING));
+   memset(&sParams, 0, sizeof(sParams));
+   pRing->iFd = syscall(__NR_io_uring_setup, iEntries, &sParams);
+   if (pRing->iFd < 0)
+      iErrno = errno;
+
+   if (!iErrno)
+   {
+      pRing->iSqRingSize = sParams.sq_off.array
+                           + sParams.sq_entries * sizeof(unsigned int);
+      pRing->iCqRingSize = sParams.cq_off.cqes
+                           + sParams.cq_entries * sizeof(struct io_uring_cqe);
+      if ((sParams.features & IORING_FEAT_SINGLE_MMAP)
+          && pRing->iCqRingSize > pRing->iSqRingSize)
+         pRing->iSqRingSize = pRing->iCqRingSize;
+      pRing->pSqRing = mmap(NULL, pRing->iSqRingSize, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, pRing->iFd,
+                            IORING_OFF_SQ_RING);
+      if (pRing->pSqRing == MAP_FAILED)
+      {
+         iErrno = errno;
+         pRing->pSqRing = NULL;
+      }
+   }
+   if (!iErrno)
+   {
+      if (sParams.features & IORING_FEAT_SINGLE_MMAP)
+         pRing->pCqRing = pRing->pSqRing;
+      else
+      {
+         pRing->pCqRing = mmap(NULL, pRing->iCqRingSize,
+                               PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                               pRing->iFd, IORING_OFF_CQ_RING);
+         if (pRing->pCqRing == MAP_FAILED)
+         {
+            iErrno = errno;
+            pRing->pCqRing = NULL;
+         }
+      }
+   }
+   if (!iErrno)
+   {
+      pRing->iSqesSize = sParams.sq_entries * sizeof(struct io_uring_sqe);
+      pRing->pSqes = mmap(NULL, pRing->iSqesSize, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, pRing->iFd,
+                          IORING_OFF_SQES);
+      if (pRing->pSqes == MAP_FAILED)
+      {
+         iErrno = errno;
+         pRing->pSqes = NULL;
+      }
+   }
+
+   if (iErrno)
+      UringClose(pRing);
+   else
+   {
+      p = (char *)pRing->pSqRing;
+      pRing->piSqHead = (unsigned int *)(p + sParams.sq_off.head);
+      pRing->piSqTail = (unsigned int *)(p + sParams.sq_off.tail);
+      pRing->piSqArray = (unsigned int *)(p + sParams.sq_off.array);
+      pRing->iSqMask = *(unsigned int *)(p + sParams.sq_off.ring_mask);
+      pRing->iSqEntries = sParams.sq_entries;
+      pRing->iSqTail = *pRing->piSqTail;
+      p = (char *)pRing->pCqRing;
+      pRing->piCqHead = (unsigned int *)(p + sParams.cq_off.head);
+      pRing->piCqTail = (unsigned int *)(p + sParams.cq_off.tail);
+      pRing->iCqMask = *(unsigned int *)(p + sParams.cq_off.ring_mask);
+      pRing->pCqes = (struct io_uring_cqe *)(p + sParams.cq_off.cqes);
+   }
+
+   return(iErrno);
+}
+
+
+
+
+/*
+ *  UringSqe
+ *
+ *  Next free submission entry, cleared, or NULL if the ring is full.
+ *  It's submitted by the next UringEnter.
+ */
+
+struct io_uring_sqe *
+UringSqe(PTURING pRing)
+{
+   unsigned int         i;
+   struct io_uring_sqe  *pSqe = NULL;
+
+
+   if (pRing->iSqTail - __atomic_load_n(pRing->piSqHead, __ATOMIC_ACQUIRE)
+       < pRing->iSqEntries)
+   {
+      i = pRing->iSqTail & pRing->iSqMask;
+      pSqe = pRing->pSqes + i;
+      memset(pSqe, 0, sizeof(struct io_uring_sqe));
+      pRing->piSqArray[i] = i;
+      pRing->iSqTail++;
+      pRing->iSqPending++;
+   }
+
+   return(pSqe);
+}
+#endif // TCPY_HAVE_IO_URING
+
+
+
+
+/*
+ *  WorkerPop
+ *
+ *  Take the newest task of the worker, or its oldest one when iSteal
+ *  is set.  The oldest tasks are the closest to the root, thus the
+ *  largest.  Returns NULL if the deque is empty.
+ */
+
+PTTASK
+WorkerPop(PTWORKER pWorker, int iSteal)
+{
+   PTTASK pTask = NULL;
+
+
+   pthread_mutex_lock(&pWorker->sMutex);
+   if (pWorker->iCount)
+   {
+      pWorker->iCount--;
+      if (iSteal)
+      {
+         pTask = pWorker->pTask[pWorker->iHead];
+         pWorker->iHead = (pWorker->iHead + 1) % pWorker->iSize;
+      }
+      else
+         pTask = pWorker->pTask[(pWorker->iHead + pWorker->iCount)
+                                % pWorker->iSize];
+   }
+   pthread_mutex_unlock(&pWorker->sMutex);
+
+   return(pTask);
+}
+
+
+
+
+/*
+ *  WorkerPush
+ *
+ *  Add a task at the bottom of the deque, which grows as needed.
+ */
+
+int
+WorkerPush(PTWORKER pWorker, PTTASK pTask)
+{
+   int      i,
+            iErr = 0,
+            iSize;
+   PTTASK   *pTaskNew;
+
+
+   pthread_mutex_lock(&pWorker->sMutex);
+   if (pWorker->iCount == pWorker->iSize)
+   {
+      iSize = pWorker->iSize ? pWorker->iSize * 2 : TASKCOUNT;
+      pTaskNew = (PTTASK *)malloc(sizeof(PTTASK) * iSize);
+      if (pTaskNew)
+      {
+         for (i = 0 ; i < pWorker->iCount ; i++)
+            pTaskNew[i] = pWorker->pTask[(pWorker->iHead + i)
+                                         % pWorker->iSize];
+         if (pWorker->pTask)
+            free(pWorker->pTask);
+         pWorker->pTask = pTaskNew;
+         pWorker->iHead = 0;
+         pWorker->iSize = iSize;
+      }
+      else
+         iErr = ERROR_TCPY_MEM;
+   }
+   if (!iErr)
+   {
+      pWorker->pTask[(pWorker->iHead + pWorker->iCount) % pWorker->iSize]
+         = pTask;
+      pWorker->iCount++;
+   }
+   pthread_mutex_unlock(&pWorker->sMutex);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  WriteBlock
+ *
+ *  Write the whole buffer.  Returns the number of bytes written, or -1
+ *  with errno set.
+ */
+
+ssize_t
+WriteBlock(int iFd, const char *pBuffer, ssize_t iSize)
+{
+   ssize_t  i,
+            iWrite = 0;
+
+
+   do
+   {
+      i = write(iFd, pBuffer + iWrite, iSize - iWrite);
+      if (i > 0)
+         iWrite += i;
+      else if (!i || errno != EINTR)
+         iWrite = -1;
+   }
+   while (iWrite >= 0 && iWrite < iSize);
+
+   return(iWrite);
+}
+
+
+
+
+/*
+ *  XattrGet
+ *
+ *  Read the user extended attribute szName of the iFd open file.  Returns the
+ *  attribute length, or -1 with errno set.
+ */
+
+ssize_t
+XattrGet(int iFd, const char *szName,     char *pValue, size_t iSize)
+{
+   ssize_t  i;
+#if defined(TCPY_HAVE_XATTR)
+   char     sz[LNSZ];
+
+
+   sprintf(sz, "user.%s", szName);
+   i = fgetxattr(iFd, sz, pValue, iSize);
+#elif defined(TCPY_HAVE_EXTATTR)
+   i = extattr_get_fd(iFd, EXTATTR_NAMESPACE_USER, szName, pValue, iSize);
+#else
+   i = -1;
+   errno = EOPNOTSUPP;
+#endif
+
+   return(i);
+}
+
+
+
+
+/*
+ *  XattrRemove
+ *
+ *  Remove the user extended attribute szName of the iFd open file.
+ *  Returns 0, or -1 with errno set.
+ */
+
+int
+XattrRemove(int iFd, const char *szName)
+{
+   int      i;
+#if defined(TCPY_HAVE_XATTR)
+   char     sz[LNSZ];
+
+
+   sprintf(sz, "user.%s", szName);
+   i = fremovexattr(iFd, sz);
+#elif defined(TCPY_HAVE_EXTATTR)
+   i = extattr_delete_fd(iFd, EXTATTR_NAMESPACE_USER, szName);
+#else
+   i = -1;
+   errno = EOPNOTSUPP;
+#endif
+
+   return(i);
+}
+
+
+
+
+/*
+ *  XattrSet
+ *
+ *  Write the user extended attribute szName of the iFd open file.
+ *  Returns 0, or -1 with errno set.
+ */
+
+int
+XattrSet(int iFd, const char *szName, const char *pValue, size_t iSize)
+{
+   int      i;
+#if defined(TCPY_HAVE_XATTR)
+   char     sz[LNSZ];
+
+
+   sprintf(sz, "user.%s", szName);
+   i = fsetxattr(iFd, sz, pValue, iSize, 0);
+#elif defined(TCPY_HAVE_EXTATTR)
+   i = (extattr_set_fd(iFd, EXTATTR_NAMESPACE_USER, szName,
+                                          pValue, iSize) < 0) ? -1 : 0;
+#else
+   i = -1;
+   errno = EOPNOTSUPP;
+#endif
+
+   return(i);
+}
+
+
+
+
+/*
+ *  PartLoad
+ *
+ *  Read the journal of the iFd part file, from its extended attribute
+ *  or else from its sidecar file.  Returns 1 if it's a copy of the same
+ *  source, pPart then holding its offset and checksum state.
+ */
+
+int
+PartLoad(PTPART pPart, int iFd)
+{
+   int                  iFdJournal,
+                        iFound = 0,
+                        iHash;
+   unsigned int         iByte;
+   size_t               i;
+   ssize_t              iLn;
+   char                 sz[LNSZ],
+                        szTail[LNSZ];
+   struct stat          sStat;
+   TCHKSTATE            sChecksum;
+   unsigned long long   iIno;
+   long long            iMtimeSec,
+                        iOffset,
+                        iSize;
+   long                 iMtimeNsec;
+
+
+   iLn = XattrGet(iFd, PARTXATTR,     sz, LNSZ - 1);
+   if (iLn <= 0)
+   {
+      iFdJournal = openat(pPart->iFdDir, pPart->szJournal, O_RDONLY);
+      if (iFdJournal >= 0)
+      {
+         iLn = ReadBlock(iFdJournal, sz, LNSZ - 1);
+         close(iFdJournal);
+      }
+   }
+
+   if (iLn > 0)
+   {
+      sz[iLn] = 0;
+      memset(&sChecksum, 0, sizeof(sChecksum));
+      if (sscanf(sz, "%d %lld %lld %ld %llu %lld %llx %llx %llx %llx %llx"
+                     " %d %64s", &iHash, &iSize, &iMtimeSec, &iMtimeNsec,
+                 &iIno, &iOffset, sChecksum.iAcc, sChecksum.iAcc + 1,
+                 sChecksum.iAcc + 2, sChecksum.iAcc + 3, &sChecksum.iLength,
+                 &sChecksum.iTail, szTail) == 13
+          && strlen(szTail) == 2 * sizeof(sChecksum.aTail)
+          && iHash == pPart->iHash && iSize == pPart->iSize
+          && iMtimeSec == pPart->iMtimeSec
+          && iMtimeNsec == pPart->iMtimeNsec && iIno == pPart->iIno
+          && sChecksum.iTail >= 0
+          && (size_t)sChecksum.iTail < sizeof(sChecksum.aTail)
+          && !fstat(iFd,     &sStat) && iOffset >= 0
+          && iOffset <= sStat.st_size && iOffset <= iSize)
+      {
+         iFound = 1;
+         for (i = 0 ; i < sizeof(sChecksum.aTail) && iFound ; i++)
+         {
+            iFound = (sscanf(szTail + 2 * i, "%2x", &iByte) == 1);
+            sChecksum.aTail[i] = iByte;
+         }
+      }
+   }
+
+   if (iFound)
+   {
+      pPart->iOffset = iOffset;
+      pPart->sChecksum = sChecksum;
+   }
+
+   return(iFound);
+}
+
+
+
+
+/*
+ *  PartOpen
+ *
+ *  Open the part file of a resumable copy of iFdSource to szDestName,
+ *  relative to iFdDir.  When its journal matches the pStat source and
+ *  the last copied bytes are still the same, the copy resumes at its
+ *  offset, else it starts over.  Both files are positioned at the
+ *  offset, *piFd is -1 if the part file name is too long.
+ */
+
+int
+PartOpen(PTPART pPart, int iFdSource, int iFdDir, const char *szDestName,
+         const char *szDest, struct stat *pStat,     int *piFd)
+{
+   int         iErr = 0;
+   ssize_t     iRead,
+               iSize;
+   off_t       iTail;
+   char        *pBuffer;
+
+
+   *piFd = -1;
+   if (!PartName(szDestName, PARTSUFFIX,     pPart->szName)
+       && !PartName(szDestName, JOURNALSUFFIX,     pPart->szJournal))
+   {
+      pPart->iFdDir = iFdDir;
+      pPart->iHash = giHash;
+      pPart->iIno = pStat->st_ino;
+      pPart->iOffset = 0;
+      pPart->iSize = pStat->st_size;
+      pPart->iMtimeSec = pStat->st_mtim.tv_sec;
+      pPart->iMtimeNsec = pStat->st_mtim.tv_nsec;
+      *piFd = openat(iFdDir, pPart->szName, O_RDWR|O_CREAT,
+                     S_IRUSR|S_IWUSR);
+      if (*piFd < 0)
+      {
+         iErr = ERROR_TCPY;
+         sprintf(gszErr, "Could Not Create %s (errno=%d)", szDest, errno);
+      }
+      else if (PartLoad(pPart, *piFd) && pPart->iOffset)
+      {
+         // The bytes before the offset are compared again, in case the
+         // journal was written before them
+         pBuffer = (char *)malloc(LNBIGBUFFER * 2);
+         iTail = pPart->iOffset < LNCOMPAREBUFFER ? pPart->iOffset
+                                                  : LNCOMPAREBUFFER;
+         if (!pBuffer
+             || lseek(iFdSource, pPart->iOffset - iTail, SEEK_SET) < 0
+             || lseek(*piFd, pPart->iOffset - iTail, SEEK_SET) < 0)
+            iTail = -1;
+         while (iTail > 0)
+         {
+            iSize = iTail < LNBIGBUFFER ? iTail : LNBIGBUFFER;
+            iRead = ReadBlock(iFdSource, pBuffer, iSize);
+            if (iRead != iSize
+                || ReadBlock(*piFd, pBuffer + LNBIGBUFFER, iSize) != iSize
+                || memcmp(pBuffer, pBuffer + LNBIGBUFFER, iSize))
+               iTail = -1;
+            else
+               iTail -= iSize;
+         }
+         if (iTail)
+            pPart->iOffset = 0;
+         if (pBuffer)
+            free(pBuffer);
+      }
+
+      if (!iErr)
+      {
+         if (!pPart->iOffset)
+            ChecksumInit(&pPart->sChecksum);
+         if (ftruncate(*piFd, pPart->iOffset)
+             || lseek(iFdSource, pPart->iOffset, SEEK_SET) < 0
+             || lseek(*piFd, pPart->iOffset, SEEK_SET) < 0)
+         {
+            iErr = ERROR_TCPY;
+            sprintf(gszErr, "Seek in file %s Failed (errno=%d)",
+                            szDest, errno);
+         }
+      }
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  PartRemove
+ *
+ *  Remove the journal of the iFd part file, once it's complete.
+ */
+
+void
+PartRemove(PTPART pPart, int iFd)
+{
+   XattrRemove(iFd, PARTXATTR);
+   unlinkat(pPart->iFdDir, pPart->szJournal, 0);
+}
+
+
+
+
+/*
+ *  PartSave
+ *
+ *  Make the iFd part file durable up to iOffset, then record it in its
+ *  journal along with the pChecksum state.  The journal goes to the
+ *  sidecar file without extended attributes.  Only a failed sync is an
+ *  error, the journal being an optimization: a journal lost in a crash
+ *  only resumes the copy from an older offset.
+ */
+
+int
+PartSave(PTPART pPart, int iFd, off_t iOffset, PTCHKSTATE pChecksum,
+         const char *szDest)
+{
+   int      iErr = 0,
+            iFdJournal;
+   size_t   i;
+   char     sz[LNSZ];
+
+
+   if (fdatasync(iFd))
+   {
+      iErr = ERROR_TCPY;
+      sprintf(gszErr, "Sync of file %s Failed (errno=%d)", szDest, errno);
+   }
+   else
+   {
+      pPart->iOffset = iOffset;
+      pPart->sChecksum = *pChecksum;
+      sprintf(sz, "%d %lld %lld %ld %llu %lld %llx %llx %llx %llx %llx %d ",
+                  pPart->iHash, (long long)pPart->iSize,
+                  (long long)pPart->iMtimeSec, pPart->iMtimeNsec,
+                  (unsigned long long)pPart->iIno, (long long)iOffset,
+                  pChecksum->iAcc[0], pChecksum->iAcc[1],
+                  pChecksum->iAcc[2], pChecksum->iAcc[3],
+                  pChecksum->iLength, pChecksum->iTail);
+      for (i = 0 ; i < sizeof(pChecksum->aTail) ; i++)
+         sprintf(sz + strlen(sz), "%02x", pChecksum->aTail[i]);
+
+      if (XattrSet(iFd, PARTXATTR, sz, strlen(sz)))
+      {
+         iFdJournal = openat(pPart->iFdDir, pPart->szJournal,
+                             O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+         if (iFdJournal >= 0)
+         {
+            if (WriteBlock(iFdJournal, sz, strlen(sz))
+                == (ssize_t)strlen(sz))
+               fdatasync(iFdJournal);
+            close(iFdJournal);
+         }
+      }
+   }
+
+   return(iErr);
+}
+
+
+
+
+///////////////////////////////////////////////////////////////////////////
+//    Level 2 : Directory Functions                                      //
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ *  CacheDirectory
+ *
+ *  The user's cache directory of tcpy, empty without a home.  With
+ *  iCreate, it's created if it doesn't exist.
+ */
+
+void
+CacheDirectory(int iCreate,     char *szDir)
+{
+   char *pSz;
+
+
+   *szDir = 0;
+   pSz = getenv("XDG_CACHE_HOME");
+   if (pSz && *pSz && strlen(pSz) < LNSZ - 30)
+      sprintf(szDir, "%s/tcpy", pSz);
+   else
+   {
+      pSz = getenv("HOME");
+      if (pSz && *pSz && strlen(pSz) < LNSZ - 30)
+         sprintf(szDir, "%s/.cache/tcpy", pSz);
+   }
+
+   if (iCreate && *szDir && mkdir(szDir, 0700) && errno == ENOENT)
+   {
+      // The .cache directory may not exist either
+      *strrchr(szDir, '/') = 0;
+      mkdir(szDir, 0700);
+      strcat(szDir, "/tcpy");
+      mkdir(szDir, 0700);
+   }
+}
+
+
+
+
+/*
+ *  CacheFind
+ *
+ *  Index slot of the sidecar entry of a file, which may be empty (-1).
+ */
+
+int
+CacheFind(dev_t iDev, ino_t iIno)
+{
+   int i;
+
+
+   i = (int)((((unsigned long long)iDev * XXH_PRIME64_1) ^ iIno)
+             * XXH_PRIME64_2 >> 33) & (giCacheSize - 1);
+   while (gpCacheIndex[i] >= 0
+          && (gpCache[gpCacheIndex[i]].iDev != iDev
+              || gpCache[gpCacheIndex[i]].iIno != iIno))
+      i = (i + 1) & (giCacheSize - 1);
+
+   return(i);
+}
+
+
+
+
+/*
+ *  CacheFlush
+ *
+ *  Append the iSize bytes of pBuffer lines to the sidecar database,
+ *  without gsMutex.  The file is locked against the other tcpy, and
+ *  opened again if one of them replaced it meanwhile.  Failures are
+ *  silent.
+ */
+
+void
+CacheFlush(const char *pBuffer, int iSize)
+{
+   int            i,
+                  iFd = -1;
+   char           sz[LNSZ];
+   struct stat    sStat,
+                  sStatPath;
+
+
+   if (iSize)
+   {
+      pthread_mutex_lock(&gsCacheMutex);
+      for (i = 0 ; i < 2 && iFd < 0 ; i++)
+      {
+         iFd = open(gszCachePath, O_WRONLY|O_APPEND|O_CREAT, 0600);
+         if (iFd < 0 && errno == ENOENT)
+         {
+            // First use, create the cache directory
+            CacheDirectory(1,     sz);
+            iFd = open(gszCachePath, O_WRONLY|O_APPEND|O_CREAT, 0600);
+         }
+         if (iFd >= 0
+             && (flock(iFd, LOCK_EX) || fstat(iFd,     &sStat)
+                 || stat(gszCachePath,     &sStatPath)
+                 || sStat.st_ino != sStatPath.st_ino))
+         {
+            close(iFd);
+            iFd = -1;
+         }
+      }
+      if (iFd >= 0)
+      {
+         WriteBlock(iFd, pBuffer, iSize);
+         if (giCacheFileSize >= 0 && !fstat(iFd,     &sStat)
+             && sStat.st_size == giCacheFileSize + iSize)
+            giCacheFileSize += iSize;
+         else
+            giCacheFileSize = -1;
+         close(iFd);
+      }
+      pthread_mutex_unlock(&gsCacheMutex);
+   }
+}
+
+
+
+
+/*
+ *  CacheInsert
+ *
+ *  Insert or replace an entry of the sidecar database in memory.
+ */
+
+int
+CacheInsert(PTCACHEENTRY pEntry)
+{
+   int            i,
+                  iErr = 0;
+   int            *pIndex;
+   PTCACHEENTRY   pCache;
+
+
+   // Keep the index at most half full
+   if (2 * (giCacheUsed + 1) > giCacheSize)
+   {
+      i = giCacheSize ? giCacheSize * 2 : 1024;
+      pCache = (PTCACHEENTRY)realloc(gpCache, i / 2 * sizeof(TCACHEENTRY));
+      pIndex = (int *)malloc(i * sizeof(int));
+      if (pCache)
+         gpCache = pCache;
+      if (pCache && pIndex)
+      {
+         if (gpCacheIndex)
+            free(gpCacheIndex);
+         gpCacheIndex = pIndex;
+         giCacheSize = i;
+         memset(gpCacheIndex, -1, giCacheSize * sizeof(int));
+         for (i = 0 ; i < giCacheUsed ; i++)
+            gpCacheIndex[CacheFind(gpCache[i].iDev, gpCache[i].iIno)] = i;
+      }
+      else
+      {
+         if (pIndex)
+            free(pIndex);
+         iErr = ERROR_TCPY_MEM;
+      }
+   }
+
+   if (!iErr)
+   {
+      i = CacheFind(pEntry->iDev, pEntry->iIno);
+      if (gpCacheIndex[i] < 0)
+         gpCacheIndex[i] = giCacheUsed++;
+      gpCache[gpCacheIndex[i]] = *pEntry;
+      gpCache[gpCacheIndex[i]].iSeq = ++giCacheSeq;
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  CacheLoad
+ *
+ *  Load the sidecar checksum database, used for the files where the
+ *  extended attributes aren't supported.  It's kept in the user's
+ *  cache directory rather than next to the files.
+ */
+
+void
+CacheLoad(void)
+{
+   char        sz[LNSZ];
+   FILE        *pFile;
+   TCACHEENTRY sEntry;
+   unsigned long long   iDev,
+                        iIno;
+   long long            iMtimeSec,
+                        iSize;
+
+
+   giCacheLoaded = 1;
+   CacheDirectory(0,     gszCachePath);
+   if (*gszCachePath)
+   {
+      strcat(gszCachePath, "/checksums");
+      pFile = fopen(gszCachePath, "r");
+      if (pFile)
+      {
+         while (fgets(sz, LNSZ, pFile))
+            if (sscanf(sz, "%llu %llu %d %llx %lld %lld %ld", &iDev, &iIno,
+                       &sEntry.iHash, &sEntry.iChecksum, &iSize, &iMtimeSec,
+                       &sEntry.iMtimeNsec) == 7)
+            {
+               giCacheLines++;
+               sEntry.iDev = iDev;
+               sEntry.iIno = iIno;
+               sEntry.iSize = iSize;
+               sEntry.iMtimeSec = iMtimeSec;
+               if (CacheInsert(&sEntry))
+                  break;
+            }
+         giCacheFileSize = feof(pFile) ? ftell(pFile) : -1;
+         fclose(pFile);
+      }
+   }
+}
+
+
+
+
+/*
+ *  CacheGet
+ *
+ *  Get the checksum of the iFd open file cached by CacheSet, if the file
+ *  size, modification time and inode number are unchanged.  The change
+ *  time can't be used because writing the extended attribute updates
+ *  it.  pStat may be NULL.  Returns 1 when *piChecksum is valid.
+ */
+
+int
+CacheGet(int iFd, struct stat *pStat,     TCHECKSUM *piChecksum)
+{
+   int                  i,
+                        iFound = 0;
+   ssize_t              iLn;
+   char                 sz[LNSZ];
+   struct stat          sStat;
+   TCACHEENTRY          sEntry;
+   unsigned long long   iIno;
+   long long            iMtimeSec,
+                        iSize;
+
+
+   if (giCache && !giTestRun)
+   {
+      if (!pStat)
+      {
+         pStat = &sStat;
+         if (fstat(iFd,     pStat))
+            pStat = NULL;
+      }
+   }
+   else
+      pStat = NULL;
+
+   if (pStat)
+   {
+      iLn = XattrGet(iFd, CACHEXATTR,     sz, LNSZ - 1);
+      if (iLn > 0)
+      {
+         sz[iLn] = 0;
+         if (sscanf(sz, "%d %llx %lld %lld %ld %llu", &sEntry.iHash,
+                    &sEntry.iChecksum, &iSize, &iMtimeSec,
+                    &sEntry.iMtimeNsec, &iIno) == 6)
+         {
+            sEntry.iDev = pStat->st_dev;
+            sEntry.iIno = iIno;
+            sEntry.iSize = iSize;
+            sEntry.iMtimeSec = iMtimeSec;
+            iFound = 1;
+         }
+      }
+      else
+      {
+         // No extended attribute, maybe not supported or not writable
+         pthread_mutex_lock(&gsMutex);
+         if (!giCacheLoaded)
+            CacheLoad();
+         if (giCacheSize)
+         {
+            i = gpCacheIndex[CacheFind(pStat->st_dev, pStat->st_ino)];
+            if (i >= 0)
+            {
+               gpCache[i].iSeq = ++giCacheSeq;
+               sEntry = gpCache[i];
+               iFound = 1;
+            }
+         }
+         pthread_mutex_unlock(&gsMutex);
+      }
+   }
+
+   if (iFound)
+      iFound = (sEntry.iHash == giHash
+                && sEntry.iIno == pStat->st_ino
+                && sEntry.iSize == pStat->st_size
+                && sEntry.iMtimeSec == pStat->st_mtim.tv_sec
+                && sEntry.iMtimeNsec == pStat->st_mtim.tv_nsec);
+   if (iFound)
+      *piChecksum = sEntry.iChecksum;
+
+   return(iFound);
+}
+
+
+
+
+/*
+ *  CacheSet
+ *
+ *  Remember the verified checksum of the iFd open file, in its extended
+ *  attributes or else in the sidecar database, by buffers of lines.
+ *  Failures are silent, the cache being an optimization only.
+ */
+
+void
+CacheSet(int iFd, TCHECKSUM iChecksum)
+{
+   int         iSize = 0;
+   char        sz[LNSZ],
+               szBuffer[CACHEBUFFER];
+   struct stat sStat;
+   TCACHEENTRY sEntry;
+
+
+   if (giCache && !giTestRun && !fstat(iFd,     &sStat))
+   {
+      sprintf(sz, "%d %llx %lld %lld %ld %llu", giHash, iChecksum,
+                  (long long)sStat.st_size, (long long)sStat.st_mtim.tv_sec,
+                  (long)sStat.st_mtim.tv_nsec,
+                  (unsigned long long)sStat.st_ino);
+      if (XattrSet(iFd, CACHEXATTR, sz, strlen(sz)))
+      {
+         pthread_mutex_lock(&gsMutex);
+         if (!giCacheLoaded)
+            CacheLoad();
+         sEntry.iDev = sStat.st_dev;
+         sEntry.iIno = sStat.st_ino;
+         sEntry.iSize = sStat.st_size;
+         sEntry.iMtimeSec = sStat.st_mtim.tv_sec;
+         sEntry.iMtimeNsec = sStat.st_mtim.tv_nsec;
+         sEntry.iHash = giHash;
+         sEntry.iChecksum = iChecksum;
+         if (!CacheInsert(&sEntry) && *gszCachePath)
+         {
+            sprintf(sz, "%llu %llu %d %llx %lld %lld %ld\n",
+                    (unsigned long long)sEntry.iDev,
+                    (unsigned long long)sEntry.iIno, sEntry.iHash,
+                    sEntry.iChecksum, (long long)sEntry.iSize,
+                    (long long)sEntry.iMtimeSec, sEntry.iMtimeNsec);
+            if (giCacheBufferUsed + strlen(sz) > CACHEBUFFER)
+            {
+               // The full buffer is written out of gsMutex
+               memcpy(szBuffer, gszCacheBuffer, giCacheBufferUsed);
+               iSize = giCacheBufferUsed;
+               giCacheBufferUsed = 0;
+            }
+            memcpy(gszCacheBuffer + giCacheBufferUsed, sz, strlen(sz));
+            giCacheBufferUsed += strlen(sz);
+            giCacheLines++;
+         }
+         pthread_mutex_unlock(&gsMutex);
+
+         CacheFlush(szBuffer, iSize);
+      }
+   }
+}
+
+
+
+
+/*
+ *  CacheCompare
+ *
+ *  qsort() order of the cache entry indexes, by last access.
+ */
+
+int
+CacheCompare(const void *p1, const void *p2)
+{
+   unsigned long long   iSeq1,
+                        iSeq2;
+
+
+   iSeq1 = gpCache[*(const int *)p1].iSeq;
+   iSeq2 = gpCache[*(const int *)p2].iSeq;
+
+   return(iSeq1 < iSeq2 ? -1 : iSeq1 > iSeq2);
+}
+
+
+
+
+/*
+ *  CacheClose
+ *
+ *  Write the last lines of the sidecar database.  Once it has more
+ *  lines than the size of the index, it's rewritten from memory with
+ *  the CACHEMAX checksums used last, in the order of their use.  The
+ *  file isn't rewritten when another tcpy appended to it since it was
+ *  read.
+ */
+
+void
+CacheClose(void)
+{
+   int         i,
+               iFd;
+   int         *pOrder;
+   char        sz[LNSZ];
+   FILE        *pFile;
+   struct stat sStat;
+
+
+   if (giCacheLoaded && *gszCachePath)
+   {
+      CacheFlush(gszCacheBuffer, giCacheBufferUsed);
+      giCacheBufferUsed = 0;
+      if (giCacheLines > giCacheSize || giCacheUsed > CACHEMAX)
+      {
+         pthread_mutex_lock(&gsCacheMutex);
+         iFd = open(gszCachePath, O_RDONLY);
+         pOrder = (int *)malloc(giCacheUsed * sizeof(int));
+         if (iFd >= 0 && pOrder && !flock(iFd, LOCK_EX)
+             && !fstat(iFd,     &sStat) && giCacheFileSize >= 0
+             && sStat.st_size == giCacheFileSize)
+         {
+            for (i = 0 ; i < giCacheUsed ; i++)
+               pOrder[i] = i;
+            qsort(pOrder, giCacheUsed, sizeof(int), CacheCompare);
+
+            sprintf(sz, "%s.tmp", gszCachePath);
+            pFile = fopen(sz, "w");
+            if (pFile)
+            {
+               for (i = giCacheUsed > CACHEMAX ? giCacheUsed - CACHEMAX : 0 ;
+                    i < giCacheUsed ; i++)
+                  fprintf(pFile, "%llu %llu %d %llx %lld %lld %ld\n",
+                          (unsigned long long)gpCache[pOrder[i]].iDev,
+                          (unsigned long long)gpCache[pOrder[i]].iIno,
+                          gpCache[pOrder[i]].iHash,
+                          gpCache[pOrder[i]].iChecksum,
+                          (long long)gpCache[pOrder[i]].iSize,
+                          (long long)gpCache[pOrder[i]].iMtimeSec,
+                          gpCache[pOrder[i]].iMtimeNsec);
+               if (fclose(pFile) || rename(sz, gszCachePath))
+                  unlink(sz);
+            }
+         }
+         if (pOrder)
+            free(pOrder);
+         if (iFd >= 0)
+            close(iFd);
+         pthread_mutex_unlock(&gsCacheMutex);
+      }
+   }
+}
+
+
+
+
+
+/*
+ *  CopyClone
+ *
+ *  Make iFdDest a reflink of iFdSource, i.e. share the same data blocks
+ *  on a copy-on-write file system.  *piCloned is set on success.
+ *  Failures are only reported in the -reflink=always mode.
+ */
+
+int
+CopyClone(int iFdSource, int iFdDest, const char *szDest,     int *piCloned)
+{
+   int iErr = 0;
+
+
+   *piCloned = 0;
+#if defined(FICLONE)
+   if (!ioctl(iFdDest, FICLONE, iFdSource))
+      *piCloned = 1;
+   else if (giReflink == TCPY_REFLINK_ALWAYS)
+   {
+      iErr = ERROR_TCPY;
+      sprintf(gszErr, "Reflink to %s Failed (errno=%d)", szDest, errno);
+   }
+#else
+   if (giReflink == TCPY_REFLINK_ALWAYS)
+   {
+      iErr = ERROR_TCPY;
+      sprintf(gszErr, "Reflink to %s Not Supported!", szDest);
+   }
+#endif
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  CopyKernel
+ *
+ *  Copy from the current offset of iFdSource using copy_file_range(),
+ *  so that no byte goes through this process.  iSize is the expected
+ *  number of bytes, only used to size the last chunk.  When the kernel
+ *  can't copy between these two files, *piFallback is set and the
+ *  offsets are left where the copy stopped.
+ */
+
+int
+CopyKernel(int iFdSource, int iFdDest, off_t iSize, const char *szDest,
+                                 ssize_t *piCopied, int *piFallback)
+{
+   int      iErr = 0;
+   ssize_t  iChunk = 0,
+            iWrite = 0;
+   TNSEC    iNano;
+   PTDEVICE pDevice;
+
+
+   *piCopied = 0;
+   *piFallback = 0;
+#if defined(TCPY_HAVE_COPY_FILE_RANGE)
+   pDevice = PacingDevice(iFdDest);
+   do
+   {
+      iChunk = LNKERNELCHUNK;
+      if (iSize > *piCopied && iSize - *piCopied < iChunk)
+         iChunk = iSize - *piCopied;
+      PacingSleep(pDevice, iChunk);
+
+      iNano = NanoTime();
+      iWrite = copy_file_range(iFdSource, NULL, iFdDest, NULL, iChunk, 0);
+      if (iWrite > 0)
+      {
+         PacingUpdate(NanoTime() - iNano, iWrite);
+         *piCopied += iWrite;
+         ByteCountAdd(iWrite);
+
+         iErr = KeyboardCheck(0);
+      }
+      else if (iWrite < 0)
+      {
+         if (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+             || errno == EOPNOTSUPP)
+            *piFallback = errno;
+         else
+         {
+            iErr = ERROR_TCPY;
+            sprintf(gszErr, "Write to file %s Failed (errno=%d)",
+                            szDest, errno);
+         }
+      }
+   }
+   while (iWrite > 0 && !iErr);
+#else
+   *piFallback = ENOSYS;
+#endif
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  CopyPipeReader
+ *
+ *  Reader thread of the copy pipeline.  A block shorter than
+ *  LNPIPEBUFFER is the last one, an empty block marks the end.
+ */
+
+void *
+CopyPipeReader(void *pArg)
+{
+   int      i = 0;
+   ssize_t  iRead;
+   PTPIPE   pPipe = (PTPIPE)pArg;
+
+
+   do
+   {
+      pthread_mutex_lock(&pPipe->sMutex);
+      while (pPipe->aState[i] != TCPY_PIPE_FREE && !pPipe->iStop)
+         pthread_cond_wait(&pPipe->sCond, &pPipe->sMutex);
+      pthread_mutex_unlock(&pPipe->sMutex);
+
+      iRead = 0;
+      if (!pPipe->iStop)
+      {
+         iRead = ReadBlock(pPipe->iFdSource, pPipe->pBuffer
+                           + (size_t)i * LNPIPEBUFFER, LNPIPEBUFFER);
+
+         pthread_mutex_lock(&pPipe->sMutex);
+         if (iRead < 0 && !pPipe->iErrno)
+            pPipe->iErrno = errno;
+         pPipe->aLength[i] = iRead;
+         pPipe->aState[i] = TCPY_PIPE_READ;
+         pthread_cond_broadcast(&pPipe->sCond);
+         pthread_mutex_unlock(&pPipe->sMutex);
+
+         i = (i + 1) % PIPECOUNT;
+      }
+   }
+   while (iRead > 0);
+
+   return(NULL);
+}
+
+
+
+
+/*
+ *  CopyPipeWriter
+ *
+ *  Writer thread of the copy pipeline.  The copy is paced here only.
+ */
+
+void *
+CopyPipeWriter(void *pArg)
+{
+   int      i = 0;
+   ssize_t  iLength = 0,
+            iWrite;
+   TNSEC    iNano;
+   PTPIPE   pPipe = (PTPIPE)pArg;
+
+
+   do
+   {
+      pthread_mutex_lock(&pPipe->sMutex);
+      while (pPipe->aState[i] != TCPY_PIPE_HASHED && !pPipe->iStop)
+         pthread_cond_wait(&pPipe->sCond, &pPipe->sMutex);
+      iLength = pPipe->iStop ? 0 : pPipe->aLength[i];
+      pthread_mutex_unlock(&pPipe->sMutex);
+
+      if (iLength > 0)
+      {
+         PacingSleep(pPipe->pDevice, iLength);
+         iNano = NanoTime();
+         iWrite = WriteBlock(pPipe->iFdDest, pPipe->pBuffer
+                             + (size_t)i * LNPIPEBUFFER, iLength);
+         PacingUpdate(NanoTime() - iNano, iLength);
+         ByteCountAdd(iLength);
+
+         pthread_mutex_lock(&pPipe->sMutex);
+         if (iWrite != iLength)
+         {
+            pPipe->iErr = ERROR_TCPY;
+            pPipe->iErrno = errno;
+            pPipe->iStop = 1;
+         }
+         pPipe->aState[i] = TCPY_PIPE_FREE;
+         pthread_cond_broadcast(&pPipe->sCond);
+         pthread_mutex_unlock(&pPipe->sMutex);
+
+         i = (i + 1) % PIPECOUNT;
+      }
+   }
+   while (iLength > 0);
+
+   return(NULL);
+}
+
+
+
+
+/*
+ *  CopyPipe
+ *
+ *  Copy from the current offset of iFdSource through a pipeline: a
+ *  reader thread fills a ring of buffers, this thread adds them to the
+ *  pChecksum state, and a writer thread drains them to iFdDest.  Both
+ *  disks can then work at the same time.
+ */
+
+int
+CopyPipe(int iFdSource, int iFdDest, const char *szSource,
+         const char *szDest,     PTCHKSTATE pChecksum)
+{
+   int         i = 0,
+               iErr = 0,
+               iReader = 0,
+               iWriter = 0;
+   ssize_t     iLength;
+   pthread_t   sReader,
+               sWriter;
+   TPIPE       sPipe;
+
+
+   memset(&sPipe, 0, sizeof(TPIPE));
+   sPipe.iFdDest = iFdDest;
+   sPipe.iFdSource = iFdSource;
+   sPipe.pDevice = PacingDevice(iFdDest);
+   if (posix_memalign((void **)&sPipe.pBuffer, LNALIGN,
+                      (size_t)PIPECOUNT * LNPIPEBUFFER))
+      iErr = ERROR_TCPY_MEM;
+   if (!iErr)
+   {
+      pthread_mutex_init(&sPipe.sMutex, NULL);
+      pthread_cond_init(&sPipe.sCond, NULL);
+      iReader = !pthread_create(&sReader, NULL, CopyPipeReader, &sPipe);
+      iWriter = !pthread_create(&sWriter, NULL, CopyPipeWriter, &sPipe);
+      if (!(iReader && iWriter))
+      {
+         iErr = ERROR_TCPY;
+         sprintf(gszErr, "Could Not Start The Copy Threads (errno=%d)",
+                         errno);
+      }
+   }
+
+   if (!iErr)
+      do
+      {
+         pthread_mutex_lock(&sPipe.sMutex);
+         while (sPipe.aState[i] != TCPY_PIPE_READ && !sPipe.iStop)
+            pthread_cond_wait(&sPipe.sCond, &sPipe.sMutex);
+         iLength = sPipe.iStop ? 0 : sPipe.aLength[i];
+         pthread_mutex_unlock(&sPipe.sMutex);
+
+         if (iLength < 0)
+         {
+            iErr = ERROR_TCPY;
+            sprintf(gszErr, "Read from file %s Failed (errno=%d)",
+                            szSource, sPipe.iErrno);
+         }
+         else if (iLength)
+         {
+            ChecksumAdd(sPipe.pBuffer + (size_t)i * LNPIPEBUFFER, iLength,
+                                                               pChecksum);
+            iErr = KeyboardCheck(0);
+         }
+
+         // The empty block is passed along so that the writer ends
+         pthread_mutex_lock(&sPipe.sMutex);
+         if (iErr)
+            sPipe.iStop = 1;
+         else
+            sPipe.aState[i] = TCPY_PIPE_HASHED;
+         pthread_cond_broadcast(&sPipe.sCond);
+         pthread_mutex_unlock(&sPipe.sMutex);
+
+         i = (i + 1) % PIPECOUNT;
+      }
+      while (iLength > 0 && !iErr);
+
+   if (iWriter)
+      pthread_join(sWriter, NULL);
+
+   // Release the reader if it's still waiting for a buffer
+   if (iReader)
+   {
+      pthread_mutex_lock(&sPipe.sMutex);
+      sPipe.iStop = 1;
+      pthread_cond_broadcast(&sPipe.sCond);
+      pthread_mutex_unlock(&sPipe.sMutex);
+      pthread_join(sReader, NULL);
+   }
+
+   if (!iErr && sPipe.iErr)
+   {
+      iErr = sPipe.iErr;
+      sprintf(gszErr, "Write to file %s Failed (errno=%d)",
+                      szDest, sPipe.iErrno);
+   }
+
+   if (sPipe.pBuffer)
+   {
+      pthread_cond_destroy(&sPipe.sCond);
+      pthread_mutex_destroy(&sPipe.sMutex);
+      free(sPipe.pBuffer);
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  CopyReadWrite
+ *
+ *  Copy from the current offset of iFdSource through gpBigBuffer.
+ *  The copied bytes are added to the pChecksum state.  The pPart part
+ *  file, if any, is saved every LNPARTCHUNK bytes.
+ */
+
+int
+CopyReadWrite(int iFdSource, int iFdDest, const char *szDest,
+              PTCHKSTATE pChecksum, PTPART pPart)
+{
+   int      iErr = 0;
+   off_t    iOffset = 0;
+   ssize_t  iRead,
+            iSize,
+            iWrite;
+   TNSEC    iNano;
+   PTDEVICE pDevice;
+
+
+   if (pPart)
+      iOffset = pPart->iOffset;
+   pDevice = PacingDevice(iFdDest);
+   do
+   {
+      iSize = BlockSizeGet();
+      iRead = read(iFdSource, gpBigBuffer, iSize);
+      if (iRead > 0)
+      {
+         ByteCountAdd(iRead);
+
+         // Slowdown for next write if needed
+         PacingSleep(pDevice, iRead);
+
+         ChecksumAdd(gpBigBuffer, iRead,     pChecksum);
+
+         iNano = NanoTime();
+         iWrite = write(iFdDest, gpBigBuffer, iRead);
+         iNano = NanoTime() - iNano;
+         PacingUpdate(iNano, iRead);
+         BlockSizeUpdate(iNano, iRead);
+
+         if (iWrite != iRead)
+         {
+            iErr = ERROR_TCPY;
+            sprintf(gszErr, "Write to file %s Failed (errno=%d)",
+                            szDest, errno);
+         }
+         iOffset += iRead;
+         if (!iErr && pPart && iOffset - pPart->iOffset >= LNPARTCHUNK)
+            iErr = PartSave(pPart, iFdDest, iOffset, pChecksum, szDest);
+      }
+      if (!iErr)
+         iErr = KeyboardCheck(0);
+   }
+   while (iRead == iSize && !iErr);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  CopyUring
+ *
+ *  Copy the first iSize bytes with io_uring.  Each block is read then
+ *  written by two linked requests, up to giQueueDepth blocks in flight,
+ *  using buffers registered once.  The completed blocks are added to
+ *  the pChecksum state in order, and *piCopied is the length copied
+ *  that way.  The pacing delays the submission of the next block,
+ *  using a timeout request instead of sleeping.  When io_uring isn't
+ *  available, *piFallback is set.  A short read stops the copy early,
+ *  the caller then continues from *piCopied.
+ */
+
+int
+CopyUring(int iFdSource, int iFdDest, off_t iSize, const char *szDest,
+                        PTCHKSTATE pChecksum, off_t *piCopied, int *piFallback)
+{
+   int                     i,
+                           iBroken = 0,
+                           iDepth,
+                           iErr = 0,
+                           iErrno = 0,
+                           iFixed = 0,
+                           iHashSlot = 0,
+                           iRing = 0,
+                           iSubmitSlot = 0,
+                           iTimeout = 0;
+   off_t                   iSubmit = 0;
+   ssize_t                 iLength;
+   char                    *pBuffer = NULL;
+   TNSEC                   iLastDone,
+                           iNano,
+                           iNextSubmit;
+#if defined(TCPY_HAVE_IO_URING)
+   struct iovec            *pIovecs = NULL;
+   struct io_uring_cqe     *pCqe;
+   struct io_uring_sqe     *pSqe;
+   struct __kernel_timespec sTimeout;
+   PTDEVICE                pDevice;
+   PTURINGSLOT             pSlot,
+                           pSlots = NULL;
+   TURING                  sRing;
+#endif
+
+
+   *piCopied = 0;
+   *piFallback = 0;
+#if defined(TCPY_HAVE_IO_URING)
+   pDevice = PacingDevice(iFdDest);
+   iDepth = giQueueDepth;
+   pSlots = (PTURINGSLOT)calloc(iDepth, sizeof(TURINGSLOT));
+   pIovecs = (struct iovec *)calloc(iDepth, sizeof(struct iovec));
+   if (posix_memalign((void **)&pBuffer, LNALIGN,
+                      (size_t)iDepth * LNPIPEBUFFER))
+      pBuffer = NULL;
+   if (!(pSlots && pIovecs && pBuffer))
+      iErr = ERROR_TCPY_MEM;
+
+   if (!iErr)
+   {
+      *piFallback = UringOpen(&sRing, 2 * iDepth + 2);
+      iRing = !(*piFallback);
+      if (iRing)
+      {
+         // Without enough locked memory, use unregistered buffers
+         for (i = 0 ; i < iDepth ; i++)
+         {
+            pIovecs[i].iov_base = pBuffer + (size_t)i * LNPIPEBUFFER;
+            pIovecs[i].iov_len = LNPIPEBUFFER;
+         }
+         iFixed = !syscall(__NR_io_uring_register, sRing.iFd,
+                           IORING_REGISTER_BUFFERS, pIovecs, iDepth);
+      }
+   }
+
+   iNextSubmit = iLastDone = NanoTime();
+   while (!iErr && iRing && !iBroken && *piCopied < iSize)
+   {
+      // Submit the next blocks, if the pacing allows it
+      pSlot = pSlots + iSubmitSlot;
+      while (pSlot->iState == TCPY_URING_FREE && iSubmit < iSize
+             && !iTimeout)
+      {
+         iNano = NanoTime();
+         if (iNano < iNextSubmit)
+         {
+            pSqe = UringSqe(&sRing);
+            sTimeout.tv_sec = (iNextSubmit - iNano) / ONESECINNANO;
+            sTimeout.tv_nsec = (iNextSubmit - iNano) % ONESECINNANO;
+            pSqe->opcode = IORING_OP_TIMEOUT;
+            pSqe->fd = -1;
+            pSqe->addr = (unsigned long)&sTimeout;
+            pSqe->len = 1;
+            pSqe->user_data = TCPY_URING_TIMEOUT;
+            iTimeout = 1;
+         }
+         else
+         {
+            iLength = LNPIPEBUFFER;
+            if (iSize - iSubmit < iLength)
+               iLength = iSize - iSubmit;
+
+            pSqe = UringSqe(&sRing);
+            pSqe->opcode = iFixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            pSqe->flags = IOSQE_IO_LINK;
+            pSqe->fd = iFdSource;
+            pSqe->addr = (unsigned long)pIovecs[iSubmitSlot].iov_base;
+            pSqe->len = iLength;
+            pSqe->off = iSubmit;
+            pSqe->buf_index = iSubmitSlot;
+            pSqe->user_data = (unsigned long long)iSubmitSlot << 1;
+
+            pSqe = UringSqe(&sRing);
+            pSqe->opcode = iFixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            pSqe->fd = iFdDest;
+            pSqe->addr = (unsigned long)pIovecs[iSubmitSlot].iov_base;
+            pSqe->len = iLength;
+            pSqe->off = iSubmit;
+            pSqe->buf_index = iSubmitSlot;
+            pSqe->user_data = ((unsigned long long)iSubmitSlot << 1) | 1;
+
+            pSlot->iState = TCPY_URING_BUSY;
+            pSlot->iPending = 2;
+            pSlot->iOffset = iSubmit;
+            pSlot->iLength = iLength;
+            iSubmit += iLength;
+            iNextSubmit = iNano + PacingDelay(pDevice, iLength);
+            iSubmitSlot = (iSubmitSlot + 1) % iDepth;
+            pSlot = pSlots + iSubmitSlot;
+         }
+      }
+
+      iErrno = UringEnter(&sRing, 1);
+      if (iErrno && iErrno != EINTR)
+      {
+         iErr = ERROR_TCPY;
+         sprintf(gszErr, "io_uring Failed (errno=%d)", iErrno);
+      }
+
+      // Reap the completions
+      while ((pCqe = UringCqe(&sRing)))
+      {
+         if (pCqe->user_data == TCPY_URING_TIMEOUT)
+            iTimeout = 0;
+         else
+         {
+            pSlot = pSlots + (pCqe->user_data >> 1);
+            pSlot->iPending--;
+            if (pCqe->res != pSlot->iLength)
+            {
+               // A failed read cancels the linked write
+               if (!(pCqe->user_data & 1) || pCqe->res == -ECANCELED)
+                  iBroken = 1;
+               else if (pSlot->iState != TCPY_URING_FAILED && !iErr)
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Write to file %s Failed (errno=%d)",
+                                  szDest, pCqe->res < 0 ? -pCqe->res : EIO);
+               }
+               pSlot->iState = TCPY_URING_FAILED;
+            }
+            else if (pCqe->user_data & 1)
+            {
+               iNano = NanoTime();
+               PacingUpdate(iNano - iLastDone, pSlot->iLength);
+               iLastDone = iNano;
+               if (pSlot->iState == TCPY_URING_BUSY)
+                  pSlot->iState = TCPY_URING_DONE;
+            }
+         }
+         UringCqeSeen(&sRing);
+      }
+
+      // Checksum the completed blocks in order
+      pSlot = pSlots + iHashSlot;
+      while (!iErr && pSlot->iState == TCPY_URING_DONE && !pSlot->iPending)
+      {
+         ChecksumAdd(pBuffer + (size_t)iHashSlot * LNPIPEBUFFER,
+                     pSlot->iLength,     pChecksum);
+         *piCopied += pSlot->iLength;
+         ByteCountAdd(pSlot->iLength);
+         pSlot->iState = TCPY_URING_FREE;
+         iHashSlot = (iHashSlot + 1) % iDepth;
+         pSlot = pSlots + iHashSlot;
+
+         iErr = KeyboardCheck(0);
+      }
+   }
+
+   // Wait for the requests still in flight before releasing the buffers
+   if (iRing)
+   {
+      do
+      {
+         i = 0;
+         for (pSlot = pSlots ; pSlot < pSlots + iDepth ; pSlot++)
+            i += pSlot->iPending;
+         if (i)
+         {
+            UringEnter(&sRing, 1);
+            while ((pCqe = UringCqe(&sRing)))
+            {
+               if (pCqe->user_data != TCPY_URING_TIMEOUT)
+                  pSlots[pCqe->user_data >> 1].iPending--;
+               UringCqeSeen(&sRing);
+            }
+         }
+      }
+      while (i);
+      UringClose(&sRing);
+   }
+
+   if (pIovecs)
+      free(pIovecs);
+   if (pSlots)
+      free(pSlots);
+#else
+   *piFallback = ENOSYS;
+#endif
+   if (pBuffer)
+      free(pBuffer);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  DirListClassify
+ *
+ *  Find the type of the entries of the iFd open directory that the file
+ *  system left DT_UNKNOWN, the other entries costing nothing.  With
+ *  io_uring, up to DIRSTATBATCH statx() requests, asking only for the
+ *  type, the size and the modification time, are submitted at a time.
+ *  fstatat() is used otherwise, or for the entries that failed.
+ */
+
+void
+DirListClassify(PTDIRLIST pList, int iFd)
+{
+   unsigned int   i,
+                  iUnknown = 0;
+   struct stat    sStat;
+#if defined(TCPY_HAVE_IO_URING)
+   int            iErrno = 0,
+                  iRing = 0;
+   unsigned int   aIndex[DIRSTATBATCH],
+                  iBatch,
+                  iDone,
+                  j;
+   struct statx   *pStatx = NULL;
+   struct io_uring_cqe  *pCqe;
+   struct io_uring_sqe  *pSqe;
+   TURING         sRing;
+#endif
+
+
+   for (i = 0 ; i < pList->iCount ; i++)
+      if (pList->pEntry[i].iType == DT_UNKNOWN)
+         iUnknown++;
+
+#if defined(TCPY_HAVE_IO_URING)
+   // A single entry isn't worth a ring
+   if (iUnknown > 1)
+   {
+      pStatx = (struct statx *)malloc(DIRSTATBATCH * sizeof(struct statx));
+      iRing = (pStatx && !UringOpen(&sRing, DIRSTATBATCH));
+   }
+
+   i = 0;
+   while (iRing && i < pList->iCount)
+   {
+      iBatch = 0;
+      for ( ; i < pList->iCount && iBatch < DIRSTATBATCH ; i++)
+         if (pList->pEntry[i].iType == DT_UNKNOWN
+             && (pSqe = UringSqe(&sRing)))
+         {
+            pSqe->opcode = IORING_OP_STATX;
+            pSqe->fd = iFd;
+            pSqe->addr = (unsigned long long)(uintptr_t)
+                         (pList->pArena + pList->pEntry[i].iName);
+            pSqe->len = STATX_TYPE|STATX_SIZE|STATX_MTIME;
+            pSqe->off = (unsigned long long)(uintptr_t)(pStatx + iBatch);
+            pSqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            pSqe->user_data = iBatch;
+            aIndex[iBatch++] = i;
+         }
+
+      // Every request of the batch completes before the next one
+      iDone = 0;
+      while (iDone < iBatch && iErrno != -1)
+      {
+         iErrno = UringEnter(&sRing, iBatch - iDone);
+         if (iErrno && iErrno != EINTR)
+         {
+            iErrno = -1;
+            iRing = 0;
+         }
+         while ((pCqe = UringCqe(&sRing)))
+         {
+            j = pCqe->user_data;
+            if (pCqe->res >= 0)
+               pList->pEntry[aIndex[j]].iType = IFTODT(pStatx[j].stx_mode);
+            else if (pCqe->res == -EINVAL)
+               iRing = 0;     // statx() isn't supported
+            UringCqeSeen(&sRing);
+            iDone++;
+         }
+      }
+   }
+
+   if (pStatx)
+   {
+      if (sRing.iFd >= 0)
+         UringClose(&sRing);
+      free(pStatx);
+   }
+#endif
+
+   for (i = 0 ; i < pList->iCount && iUnknown ; i++)
+      if (pList->pEntry[i].iType == DT_UNKNOWN
+          && !fstatat(iFd, pList->pArena + pList->pEntry[i].iName,     &sStat,
+                      AT_SYMLINK_NOFOLLOW))
+         pList->pEntry[i].iType = IFTODT(sStat.st_mode);
+}
+
+
+
+
+/*
+ *  DirectoryExist
+ */
+
+int
+DirectoryExist(const char *szPathname,     struct stat *pStat)
+{
+   int i;
+   struct stat sStat, *pStat2;
+
+
+   if (pStat)
+      pStat2 = pStat;
+   else
+      pStat2 = &sStat;
+
+   i = !stat(szPathname,     pStat2);
+   if (i)
+      i = (pStat2->st_mode & S_IFDIR);
+
+#ifdef TCPY_DEBUG
+   printf("\n%d = DirectoryExist(%s), st_mode=0%o\n", i, szPathname, (unsigned int)(pStat2->st_mode));
+#endif // TCPY_DEBUG
+
+   return(i);
+}
+
+
+
+
+/*
+ *  DirectoryRemove
+ *
+ *  Delete the szName directory of iFdParent, bottom-up, each directory
+ *  being read through its own descriptor.  The entries that can't be
+ *  deleted are counted in *piFailed.
+ */
+
+int
+DirectoryRemove(int iFdParent, const char *szName,     int *piFailed)
+{
+   int      iDir,
+            iErr = 0,
             iFd;
-   ssize_t  iRead;
-   char     sz[LNSZ];
+   DIR      *pDir = NULL;
+   struct dirent  *pDirEntry;
+   struct stat    sStat;
+
+
+   iFd = openat(iFdParent, szName, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+   if (iFd >= 0)
+   {
+      pDir = fdopendir(iFd);
+      if (!pDir)
+         close(iFd);
+   }
+   if (pDir)
+   {
+      do
+      {
+         pDirEntry = readdir(pDir);
+         if (pDirEntry && strcmp(pDirEntry->d_name, ".")
+                       && strcmp(pDirEntry->d_name, ".."))
+         {
+            iDir = (pDirEntry->d_type == DT_DIR);
+            if (pDirEntry->d_type == DT_UNKNOWN
+                && !fstatat(dirfd(pDir), pDirEntry->d_name,     &sStat,
+                            AT_SYMLINK_NOFOLLOW))
+               iDir = S_ISDIR(sStat.st_mode);
+
+            if (iDir)
+               iErr = DirectoryRemove(dirfd(pDir), pDirEntry->d_name,
+                                                             piFailed);
+            else if (unlinkat(dirfd(pDir), pDirEntry->d_name, 0))
+               (*piFailed)++;
+         }
+      }
+      while (pDirEntry && !iErr);
+
+      closedir(pDir);
+   }
+
+   if (!iErr)
+      iErr = KeyboardCheck(0);
+   if (!iErr && unlinkat(iFdParent, szName, AT_REMOVEDIR))
+      (*piFailed)++;
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  DirectoryValidate
+ */
+
+int
+DirectoryValidate(const char *szPathname,     struct stat *pStat)
+{
+   int   i,
+         iErr = 0;
+   char  sz[LNSZ],
+         sz2[LNSZ],
+         *pSzDirname;
+   struct stat sStat, *pStat2;
+
+
+   i = strlen(szPathname);
+   if (i)
+   {
+      if (pStat)
+         pStat2 = pStat;
+      else
+         pStat2 = &sStat;
+
+      if (!DirectoryExist(szPathname,     pStat2))
+      {
+         pSzDirname = (char *)malloc(i + 10);
+         if (pSzDirname)
+         {
+            strcpy(pSzDirname, szPathname);
+            if (pSzDirname[i - 1] == '/')    // Slash the ending slash
+            {
+               i--;
+               pSzDirname[i] = 0;
+            }
+
+            // Make sure that the parent directory exists
+            while (i && pSzDirname[i] != '/')
+               i--;
+            if (pSzDirname[i] == '/')
+            {
+               if (i)
+               {
+                  pSzDirname[i] = 0;
+                  iErr = DirectoryValidate(pSzDirname,     pStat2);
+                  pSzDirname[i] = '/';
+               }
+               else
+                  stat("/",     pStat2);
+            }
+            else
+               stat(".",     pStat2);
+
+            if (!iErr)
+            {
+               StringShortner(pSzDirname, LNSZ - 40,     sz);
+               sprintf(sz2, "mkdir(%s, Mode=0%o)", sz,
+                            (unsigned int)pStat2->st_mode);
+               EchoPrint(sz2);
+               if (mkdir(pSzDirname, pStat2->st_mode))
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Could Not Create %s (errno=%d)",
+                                  sz, errno);
+               }
+               else
+                  stat(pSzDirname,     pStat2);
+            }
+      
+            free(pSzDirname);
+         }
+         else
+            iErr = ERROR_TCPY_MEM;
+      }
+   }
+   else if (pStat)
+      // Not throwing an error but making sure there is no side effect
+      memset(pStat, 0, sizeof(struct stat));
+
+   return(iErr);                            
+}
+
+
+
+
+/*
+ *  DirectoryValidateAt
+ *
+ *  Create the szPathname directory in the iFdDir open directory, with
+ *  the same mode, unless it already exists.
+ */
+
+int
+DirectoryValidateAt(int iFdDir, const char *szPathname)
+{
+   int         iErr = 0;
+   char        sz[LNSZ],
+               sz2[LNSZ];
+   const char  *pSzName;
+   struct stat sStat;
+
+
+   pSzName = PathAt(iFdDir, szPathname);
+   if (fstatat(iFdDir, pSzName,     &sStat, 0) || !S_ISDIR(sStat.st_mode))
+   {
+      if (fstat(iFdDir,     &sStat))
+         sStat.st_mode = S_IRWXU;
+
+      StringShortner(szPathname, LNSZ - 40,     sz);
+      sprintf(sz2, "mkdir(%s, Mode=0%o)", sz, (unsigned int)sStat.st_mode);
+      EchoPrint(sz2);
+      if (mkdirat(iFdDir, pSzName, sStat.st_mode))
+      {
+         iErr = ERROR_TCPY;
+         sprintf(gszErr, "Could Not Create %s (errno=%d)", sz, errno);
+      }
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  FilenameChecksum
+ *
+ *  Checksum of the iFd open file, read from its start.  When iCached is
+ *  set, a checksum cached by CacheSet is used instead of reading the
+ *  file.
+ */
+
+int
+FilenameChecksum(int iFd, const char *szFilename, int iCached,
+                                                  TCHECKSUM *piChecksum)
+{
+   int         iErr = 0;
+   ssize_t     iRead,
+               iSize;
+   char        sz[LNSZ];
+   TCHKSTATE   sState;
+
+
+   *piChecksum = 0;
+   if (!(iCached && CacheGet(iFd, NULL,     piChecksum)))
+   {
+      ChecksumInit(&sState);
+      if (lseek(iFd, 0, SEEK_SET) < 0)
+      {
+         iErr = ERROR_TCPY;
+         StringShortner(szFilename, LNSZ - 50,     sz);
+         sprintf(gszErr, "Seek in file %s Failed (errno=%d)", sz, errno);
+      }
+      else
+      {
+         do
+         {
+            iSize = BlockSizeGet();
+            iRead = read(iFd, gpBigBuffer, iSize);
+            if (iRead > 0)
+               ChecksumAdd(gpBigBuffer, iRead,     &sState);
+
+            iErr = KeyboardCheck(0);
+         }
+         while (iRead == iSize && !iErr);
+
+         if (!iErr)
+            *piChecksum = ChecksumValue(&sState);
+      }
+   }
+   
+   return(iErr);                            
+}
+
+
+
+
+/*
+ *  FilenameCompare
+ *
+ *  Compare the content of two newly opened files of the same size.  The
+ *  source is read by this thread while the destination is read by a
+ *  helper thread, so that both disks work at the same time.  Both
+ *  streams are compared in lockstep, and the comparison stops at the
+ *  first difference, at offset *piOffset.  When both files are the
+ *  same, *piChecksum is the checksum of the source, otherwise it's 0 and
+ *  *piDiffer is set.
+ */
+
+int
+FilenameCompare(int iFdSource, int iFdDest, const char *szSourceFilename,
+                const char *szDestFilename, off_t iSize,
+                                 TCHECKSUM *piChecksum, int *piDiffer,
+                                 off_t *piOffset)
+{
+   int         iErr = 0,
+               iThread = 0;
+   ssize_t     i;
+   char        sz[LNSZ];
+   pthread_t   sThread;
+   TREADER     sDest,
+               sSource;
+
+
+   *piChecksum = 0;
+   *piDiffer = 0;
+   *piOffset = 0;
+   memset(&sSource, 0, sizeof(TREADER));
+   memset(&sDest, 0, sizeof(TREADER));
+   sSource.iFd = iFdSource;
+   sDest.iFd = iFdDest;
+   sSource.iHash = 1;
+   sSource.iSize = sDest.iSize = LNCOMPAREBUFFER;
+   ChecksumInit(&sSource.sChecksum);
+   if (posix_memalign((void **)&sSource.pBuffer, LNALIGN, LNCOMPAREBUFFER))
+      sSource.pBuffer = NULL;
+   if (posix_memalign((void **)&sDest.pBuffer, LNALIGN, LNCOMPAREBUFFER))
+      sDest.pBuffer = NULL;
+   if (!(sSource.pBuffer && sDest.pBuffer))
+      iErr = ERROR_TCPY_MEM;
+
+   // A single block isn't worth a thread
+   if (!iErr && iSize > LNCOMPAREBUFFER)
+   {
+      pthread_mutex_init(&sDest.sMutex, NULL);
+      pthread_cond_init(&sDest.sCond, NULL);
+      iThread = !pthread_create(&sThread, NULL, ReaderThread, &sDest);
+   }
+
+   if (!iErr)
+      do
+      {
+         if (iThread)
+            ReaderStart(&sDest);
+         ReaderRead(&sSource);
+         if (iThread)
+            ReaderWait(&sDest);
+         else
+            ReaderRead(&sDest);
+
+         if (sSource.iRead < 0 || sDest.iRead < 0)
+         {
+            iErr = ERROR_TCPY;
+            StringShortner(sSource.iRead < 0 ? szSourceFilename
+                                             : szDestFilename,
+                           LNSZ - 50,     sz);
+            sprintf(gszErr, "Could Not Read %s (errno=%d)", sz,
+                    sSource.iRead < 0 ? sSource.iErrno : sDest.iErrno);
+         }
+         else if (sSource.iRead != sDest.iRead
+                  || memcmp(sSource.pBuffer, sDest.pBuffer, sSource.iRead))
+         {
+            *piDiffer = 1;
+            for (i = 0 ; i < sSource.iRead && i < sDest.iRead
+                         && sSource.pBuffer[i] == sDest.pBuffer[i] ; i++)
+               ;
+            *piOffset += i;
+         }
+         else
+         {
+            *piOffset += sSource.iRead;
+            iErr = KeyboardCheck(0);
+         }
+      }
+      while (sSource.iRead == LNCOMPAREBUFFER && !iErr && !(*piDiffer));
+
+   if (iThread)
+   {
+      pthread_mutex_lock(&sDest.sMutex);
+      sDest.iStop = 1;
+      pthread_cond_signal(&sDest.sCond);
+      pthread_mutex_unlock(&sDest.sMutex);
+      pthread_join(sThread, NULL);
+      pthread_cond_destroy(&sDest.sCond);
+      pthread_mutex_destroy(&sDest.sMutex);
+   }
+
+   if (!iErr && !(*piDiffer))
+      *piChecksum = ChecksumValue(&sSource.sChecksum);
+
+   if (sDest.pBuffer)
+      free(sDest.pBuffer);
+   if (sSource.pBuffer)
+      free(sSource.pBuffer);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  FilenameExist
+ *
+ *  szPathname is looked up in its iFdDir parent directory, see PathAt.
+ */
+
+int
+FilenameExist(int iFdDir, const char *szPathname,     struct stat *pStat)
+{
+   int i;
+   struct stat sStat, *pStat2;
+
+
+   if (pStat)
+      pStat2 = pStat;
+   else
+      pStat2 = &sStat;
+
+   i = !fstatat(iFdDir, PathAt(iFdDir, szPathname),     pStat2, 0);
+   if (i)
+      i = (pStat2->st_mode & S_IFREG);
+
+#ifdef TCPY_DEBUG
+   printf("\n%d = FilenameExist(%s), st_mode=0%o\n", i, szPathname, (unsigned int)(pStat2->st_mode));
+#endif // TCPY_DEBUG
+
+   return(i);
+}
+
+
+
+
+/*
+ *  FilenameOpen
+ *
+ *  Open szFilename for reading, relative to its iFdDir parent directory.
+ */
+
+int
+FilenameOpen(int iFdDir, const char *szFilename,     int *piFd)
+{
+   int   iErr = 0;
+   char  sz[LNSZ];
+
+
+   *piFd = openat(iFdDir, PathAt(iFdDir, szFilename), O_RDONLY);
+   if (*piFd < 0)
+   {
+      iErr = ERROR_TCPY;
+      StringShortner(szFilename, LNSZ - 50,     sz);
+      sprintf(gszErr, "Could Not Open %s (errno=%d)", sz, errno);
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  FilenameSample
+ *
+ *  Compare the head, the tail, and giSampleCount random blocks of two
+ *  open files of the same size.  *piDiffer is set on the first difference,
+ *  at offset *piOffset.
+ */
+
+int
+FilenameSample(int iFdSource, int iFdDest, const char *szSourceFilename,
+               const char *szDestFilename, off_t iSize,
+                                           int *piDiffer, off_t *piOffset)
+{
+   int      i,
+            iErr = 0;
+   off_t    iBlockCount,
+            iOffset;
+   ssize_t  iReadDest,
+            iReadSource,
+            j;
+   char     *pBuffer = NULL,
+            sz[LNSZ];
+
+
+   *piDiffer = 0;
+   *piOffset = 0;
+   pBuffer = (char *)malloc(LNBIGBUFFER);
+   if (!pBuffer)
+      iErr = ERROR_TCPY_MEM;
+
+   iBlockCount = (iSize + LNBIGBUFFER - 1) / LNBIGBUFFER;
+   for (i = 0 ; i < giSampleCount + 2 && !iErr && !(*piDiffer) ; i++)
+   {
+      // Head, tail, then random blocks
+      if (!i)
+         iOffset = 0;
+      else if (i == 1)
+         iOffset = (iBlockCount - 1) * LNBIGBUFFER;
+      else
+         iOffset = ((((off_t)random() << 31) ^ random()) % iBlockCount)
+                   * LNBIGBUFFER;
+
+      iReadSource = pread(iFdSource, gpBigBuffer, LNBIGBUFFER, iOffset);
+      iReadDest = pread(iFdDest, pBuffer, LNBIGBUFFER, iOffset);
+      if (iReadSource < 0 || iReadDest < 0)
+      {
+         iErr = ERROR_TCPY;
+         StringShortner(iReadSource < 0 ? szSourceFilename : szDestFilename,
+                        LNSZ - 50,     sz);
+         sprintf(gszErr, "Could Not Read %s (errno=%d)", sz, errno);
+      }
+      else if (iReadSource != iReadDest
+               || memcmp(gpBigBuffer, pBuffer, iReadSource))
+      {
+         *piDiffer = 1;
+         for (j = 0 ; j < iReadSource && j < iReadDest
+                      && gpBigBuffer[j] == pBuffer[j] ; j++)
+            ;
+         *piOffset = iOffset + j;
+      }
+      else
+         iErr = KeyboardCheck(0);
+
+      if (iBlockCount == 1)
+         break;
+   }
+
+   if (pBuffer)
+      free(pBuffer);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  ManifestFind
+ *
+ *  Slot of the iKey record in the manifest index, or of its free slot.
+ */
+
+int
+ManifestFind(unsigned long long iKey)
+{
+   int i;
+
+
+   i = (int)(iKey * XXH_PRIME64_2 >> 33) & (giManifestSize - 1);
+   while (gpManifestIndex[i] >= 0
+          && gpManifest[gpManifestIndex[i]].iKey != iKey)
+      i = (i + 1) & (giManifestSize - 1);
+
+   return(i);
+}
+
+
+
+
+/*
+ *  ManifestFlush
+ *
+ *  Append iCount pEntries records to the manifest, without gsMutex.
+ *  The destination file system is synced first, so that a record is
+ *  only durable after the data of its file.  A manifest that can't be
+ *  written is dropped, it's only a shortcut.
+ */
+
+void
+ManifestFlush(PTMANIFESTENTRY pEntries, int iCount)
+{
+   ssize_t iSize;
+
+
+   pthread_mutex_lock(&gsManifestMutex);
+   if (iCount && giManifestFd >= 0)
+   {
+#if defined(__linux__)
+      if (giManifestDestFd < 0 || syncfs(giManifestDestFd))
+#endif
+         sync();
+      iSize = iCount * sizeof(TMANIFESTENTRY);
+      if (write(giManifestFd, pEntries, iSize) != iSize
+          || fdatasync(giManifestFd))
+      {
+         printf("\nWARNING: Failed to write the manifest (errno=%d)\n",
+                errno);
+         pthread_mutex_lock(&gsMutex);
+         close(giManifestFd);
+         giManifestFd = -1;
+         pthread_mutex_unlock(&gsMutex);
+      }
+   }
+   pthread_mutex_unlock(&gsManifestMutex);
+}
+
+
+
+
+/*
+ *  ManifestHash
+ *
+ *  FNV-1a hash of a name, 64 bits, continued from iHash.
+ */
+
+unsigned long long
+ManifestHash(unsigned long long iHash, const char *szName)
+{
+   while (*szName)
+   {
+      iHash ^= (unsigned char)*szName;
+      iHash *= 0x100000001B3ULL;
+      szName++;
+   }
+
+   return(iHash);
+}
+
+
+
+
+/*
+ *  ManifestAdd
+ *
+ *  Record the szSourceFilename file as done, copied or verified.
+ */
+
+void
+ManifestAdd(const char *szSourceFilename, struct stat *pStat,
+            TCHECKSUM iChecksum)
+{
+   int             iCount = 0;
+   PTMANIFESTENTRY pEntry;
+   TMANIFESTENTRY  sEntries[MANIFESTBUFFER];
+
+
+   pthread_mutex_lock(&gsMutex);
+   if (giManifestFd >= 0)
+   {
+      pEntry = gsManifestBuffer + giManifestUsed++;
+      pEntry->iKey = ManifestHash(MANIFESTFNV, szSourceFilename);
+      pEntry->iSize = pStat->st_size;
+      pEntry->iMtimeSec = pStat->st_mtim.tv_sec;
+      pEntry->iMtimeNsec = pStat->st_mtim.tv_nsec;
+      pEntry->iChecksum = iChecksum;
+      if (giManifestUsed == MANIFESTBUFFER)
+      {
+         // The full buffer is written out of gsMutex
+         memcpy(sEntries, gsManifestBuffer, sizeof(sEntries));
+         iCount = giManifestUsed;
+         giManifestUsed = 0;
+      }
+   }
+   pthread_mutex_unlock(&gsMutex);
+
+   ManifestFlush(sEntries, iCount);
+}
+
+
+
+
+/*
+ *  ManifestClose
+ *
+ *  Once the copy is done, the manifest isn't needed anymore.
+ *  Otherwise it's kept for the next run with -resume.
+ */
+
+void
+ManifestClose(int iDone)
+{
+   ManifestFlush(gsManifestBuffer, giManifestUsed);
+   giManifestUsed = 0;
+   if (gpManifest)
+   {
+      munmap(gpManifest, giManifestCount * sizeof(TMANIFESTENTRY));
+      gpManifest = NULL;
+   }
+   if (gpManifestIndex)
+   {
+      free(gpManifestIndex);
+      gpManifestIndex = NULL;
+   }
+   if (giManifestFd >= 0)
+   {
+      close(giManifestFd);
+      giManifestFd = -1;
+      if (iDone)
+         unlink(gszManifestPath);
+   }
+   if (giManifestDestFd >= 0)
+   {
+      close(giManifestDestFd);
+      giManifestDestFd = -1;
+   }
+}
+
+
+
+
+/*
+ *  ManifestOpen
+ *
+ *  With -resume, the manifest of the szSourceDir to szDestDir copy is an
+ *  array of fixed size records in the cache directory, appended as the
+ *  files are done.  The records of the previous runs, if any, are
+ *  mapped in memory and indexed, a torn last record being cut, then the
+ *  run continues the same manifest.
+ */
+
+int
+ManifestOpen(const char *szSourceDir, const char *szDestDir)
+{
+   int               i,
+                     iErr = 0;
+   unsigned long long   iHash;
+   char              sz[LNSZ];
+   struct stat       sStat;
+   TMANIFESTENTRY    sHeader;
+
+
+   *gszManifestPath = 0;
+   if (giResume && !giTestRun)
+      CacheDirectory(1,     gszManifestPath);
+   if (*gszManifestPath)
+   {
+      if (!getcwd(sz, LNSZ))
+         *sz = 0;
+      iHash = ManifestHash(MANIFESTFNV, sz);
+      iHash = ManifestHash(iHash, "\n");
+      iHash = ManifestHash(iHash, szSourceDir);
+      iHash = ManifestHash(iHash, "\n");
+      iHash = ManifestHash(iHash, szDestDir);
+      sprintf(gszManifestPath + strlen(gszManifestPath), "/manifest-%016llx",
+              iHash);
+
+      giManifestDestFd = open(szDestDir, O_RDONLY|O_DIRECTORY);
+      giManifestFd = open(gszManifestPath, O_RDWR|O_APPEND|O_CREAT, 0600);
+      if (giManifestFd >= 0 && !fstat(giManifestFd,     &sStat))
+      {
+         giManifestCount = (int)(sStat.st_size / sizeof(TMANIFESTENTRY));
+         if (giManifestCount > 1
+             && !ftruncate(giManifestFd,
+                           giManifestCount * sizeof(TMANIFESTENTRY)))
+         {
+            gpManifest = (PTMANIFESTENTRY)mmap(NULL,
+                                 giManifestCount * sizeof(TMANIFESTENTRY),
+                                 PROT_READ, MAP_SHARED, giManifestFd, 0);
+            if (gpManifest == MAP_FAILED)
+               gpManifest = NULL;
+         }
+         if (gpManifest && (gpManifest->iKey != MANIFESTMAGIC
+                            || gpManifest->iSize != giHash))
+         {
+            // Another format or checksum, start over
+            munmap(gpManifest, giManifestCount * sizeof(TMANIFESTENTRY));
+            gpManifest = NULL;
+         }
+         if (gpManifest)
+         {
+            // Keep the index at most half full, the last record of
+            // a file wins
+            for (giManifestSize = 1024 ;
+                 giManifestSize < 2 * giManifestCount ; )
+               giManifestSize *= 2;
+            gpManifestIndex = (int *)malloc(giManifestSize * sizeof(int));
+            if (gpManifestIndex)
+            {
+               memset(gpManifestIndex, -1, giManifestSize * sizeof(int));
+               for (i = 1 ; i < giManifestCount ; i++)
+                  gpManifestIndex[ManifestFind(gpManifest[i].iKey)] = i;
+               sprintf(sz, "Resume after %d files done", giManifestCount - 1);
+               EchoPrint(sz);
+            }
+            else
+               iErr = ERROR_TCPY_MEM;
+         }
+         else if (ftruncate(giManifestFd, 0))
+         {
+            close(giManifestFd);
+            giManifestFd = -1;
+         }
+      }
+
+      if (giManifestFd >= 0 && !gpManifest)
+      {
+         memset(&sHeader, 0, sizeof(sHeader));
+         sHeader.iKey = MANIFESTMAGIC;
+         sHeader.iSize = giHash;
+         if (write(giManifestFd, &sHeader, sizeof(sHeader))
+             != sizeof(sHeader))
+         {
+            close(giManifestFd);
+            giManifestFd = -1;
+         }
+      }
+      if (giManifestFd < 0)
+      {
+         StringShortner(gszManifestPath, LNSZ - 60,     sz);
+         printf("\nWARNING: Failed to open the %s manifest (errno=%d)\n",
+                sz, errno);
+      }
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  MirrorCleanup
+ *
+ *  Delete the files of the iFdDestDir open directory, szDestDir, that
+ *  are no longer present in the source directory, pNames and pDirs
+ *  holding the names of the files and of the directories read from it.
+ *  The source isn't accessed at all.  The part files of the source
+ *  files are kept.  The names of the stale directories are added to
+ *  pStale, for MirrorPurge.
+ */
+
+int
+MirrorCleanup(PTNAMESET pNames, PTNAMESET pDirs, int iFdDestDir,
+              const char *szDestDir,     PTNAMESET pStale)
+{
+   int            iErr = 0;
+   unsigned int   i;
+   char           sz[LNSZ],
+                  sz2[LNSZ],
+                  *pSzFilenameDest;
+   const char     *pSz;
+   TDIRLIST       sList;
+
+
+   memset(&sList, 0, sizeof(sList));
+   pSzFilenameDest = (char *)malloc(strlen(szDestDir) + LNSZ + 10);
+   if (!pSzFilenameDest)
+      iErr = ERROR_TCPY_MEM;
+
+   if (!iErr)
+      iErr = DirListRead(&sList, iFdDestDir, szDestDir);
+   if (!iErr)
+      DirListClassify(&sList, iFdDestDir);
+   for (i = 0 ; i < sList.iCount && !iErr ; i++)
+   {
+      pSz = sList.pArena + sList.pEntry[i].iName;
+      if (sList.pEntry[i].iType == DT_DIR && !NameSetFind(pDirs, pSz))
+         iErr = NameSetAdd(pStale, pSz);
+      else if ((sList.pEntry[i].iType & DT_REG) == DT_REG
+               && !NameSetFind(pNames, pSz)
+               && !(PartSource(pSz,     sz) && NameSetFind(pNames, sz)))
+      {
+         strcpy(pSzFilenameDest, szDestDir);
+         strcat(pSzFilenameDest, pSz);
+         StringShortner(pSzFilenameDest, LNSZ - 30,     sz);
+         sprintf(sz2, "Delete %s", sz);
+         EchoPrint(sz2);
+         if (!giTestRun)
+            if (unlinkat(iFdDestDir, pSz, 0))
+               printf("\nWARNING: Failed to delete %s\n", sz);
+      }
+   }
+
+   DirListFree(&sList);
+   if (pSzFilenameDest)
+      free(pSzFilenameDest);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  MirrorPurge
+ *
+ *  Delete the szDir stale directory of the mirror and all its content,
+ *  iFdDir being its parent directory.
+ */
+
+int
+MirrorPurge(int iFdDir, const char *szDir)
+{
+   int   iErr = 0,
+         iFailed = 0;
+   char  sz[LNSZ],
+         sz2[LNSZ];
+
+
+   StringShortner(szDir, LNSZ - 50,     sz);
+   sprintf(sz2, "Delete %s", sz);
+   EchoPrint(sz2);
+   if (!giTestRun)
+   {
+      iErr = DirectoryRemove(iFdDir, PathAt(iFdDir, szDir),     &iFailed);
+      if (iFailed)
+         printf("\nWARNING: Failed to delete %d entries of %s\n", iFailed,
+                                                                  sz);
+   }
+
+   return(iErr);
+}
+
+
+
+
+///////////////////////////////////////////////////////////////////////////
+//    Level 3 : Sub-systems                                              //
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ *  ControlCommand
+ *
+ *  Execute the szCmd command received on the control socket, its reply
+ *  in szReply.  The rate is the -bwlimit of the next writes, 0 to
+ *  remove it.
+ */
+
+void
+ControlCommand(const char *szCmd,     char *szReply)
+{
+   int         i;
+   long long   iRate;
+   char        *pSz;
+
+
+   strcpy(szReply, "ok\n");
+   if (!strcmp(szCmd, "pause"))
+      KeyboardKey(KEYPAUSE);
+   else if (!strcmp(szCmd, "resume"))
+      KeyboardKey(KEYRESUME);
+   else if (!strcmp(szCmd, "stop"))
+      KeyboardKey('q');
+   else if (!strcmp(szCmd, "verify"))
+      KeyboardKey('v');
+   else if (!strncmp(szCmd, "rate ", 5))
+   {
+      iRate = SizeParse(szCmd + 5,     &pSz);
+      if (*pSz || iRate < 0 || iRate > ONESECINNANO * 1024LL)
+         strcpy(szReply, "error: invalid rate\n");
+      else
+      {
+         pthread_mutex_lock(&gsMutex);
+         giBwLimit = iRate;
+         giBwBurst = iRate / 10;
+         if (giBwBurst < LNBIGBUFFER)
+            giBwBurst = LNBIGBUFFER;
+
+         // The throttle keeps its own rate, under the limit
+         if (giPacing != TCPY_PACING_THROTTLE)
+            giPacing = (giBwLimit || giIopsLimit) ? TCPY_PACING_BUCKET
+                       : giFaster ? TCPY_PACING_OFF : TCPY_PACING_ADAPTIVE;
+         for (i = 0 ; i < giDeviceCount ; i++)
+            if (giPacing != TCPY_PACING_THROTTLE
+                || (iRate && gsDevice[i].iBwRate > iRate))
+               gsDevice[i].iBwRate = iRate;
+         pthread_mutex_unlock(&gsMutex);
+      }
+   }
+   else if (!strcmp(szCmd, "stats"))
+   {
+      pthread_mutex_lock(&gsMutex);
+      sprintf(szReply, "files=%d cloned=%d bytes=%lld rate=%lld"
+                       " paused=%d verify=%d\n", giCopyFileCount,
+                       giCloneFileCount, (long long)giTotalByteCount,
+                       giBwLimit, (int)giPaused, giPauseAfterVerif);
+      pthread_mutex_unlock(&gsMutex);
+   }
+   else
+      strcpy(szReply, "error: unknown command\n");
+}
+
+
+
+
+/*
+ *  ControlOpen
+ *
+ *  Listen on the szPathname Unix socket for the ControlThread.  A
+ *  socket left by a previous run is replaced.
+ */
+
+int
+ControlOpen(const char *szPathname)
+{
+   int                  iErr = 0;
+   char                 sz[LNSZ];
+   struct sockaddr_un   sAddr;
+   struct stat          sStat;
+
+
+   memset(&sAddr, 0, sizeof(sAddr));
+   sAddr.sun_family = AF_UNIX;
+   if (strlen(szPathname) >= sizeof(sAddr.sun_path))
+      iErr = ERROR_TCPY_USAGE;
+   else
+   {
+      strcpy(sAddr.sun_path, szPathname);
+      if (!lstat(szPathname,     &sStat) && S_ISSOCK(sStat.st_mode))
+         unlink(szPathname);
+
+      giControlFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (giControlFd < 0
+          || bind(giControlFd, (struct sockaddr *)&sAddr, sizeof(sAddr))
+          || chmod(szPathname, S_IRUSR | S_IWUSR)
+          || listen(giControlFd, CTLCLIENTS)
+          || pipe(giControlPipe))
+      {
+         iErr = ERROR_TCPY;
+         StringShortner(szPathname, LNSZ - 50,     sz);
+         sprintf(gszErr, "Could Not Listen On %s (errno=%d)", sz, errno);
+         if (giControlFd >= 0)
+            close(giControlFd);
+         giControlFd = -1;
+      }
+   }
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  ControlThread
+ *
+ *  Read the commands of up to CTLCLIENTS clients of the control socket,
+ *  one per line, and reply to them.  A byte in giControlPipe ends the
+ *  thread.
+ */
+
+void *
+ControlThread(void *pArg)
+{
+   int            aUsed[CTLCLIENTS],
+                  i,
+                  iFd,
+                  iRun = 1,
+                  j;
+   ssize_t        iLength;
+   char           aLine[CTLCLIENTS][LNSZ],
+                  *pSz,
+                  szReply[LNSZ];
+   struct pollfd  sPoll[CTLCLIENTS + 2];
+
+
+   sPoll[0].fd = giControlPipe[0];
+   sPoll[1].fd = giControlFd;
+   for (i = 0 ; i < CTLCLIENTS + 2 ; i++)
+   {
+      if (i > 1)
+         sPoll[i].fd = -1;
+      sPoll[i].events = POLLIN;
+   }
+
+   while (iRun)
+   {
+      if (poll(sPoll, CTLCLIENTS + 2, -1) > 0)
+      {
+         if (sPoll[0].revents)
+            iRun = 0;
+
+         if (sPoll[1].revents)
+         {
+            iFd = accept(giControlFd, NULL, NULL);
+            for (i = 0 ; i < CTLCLIENTS && iFd >= 0 ; i++)
+               if (sPoll[i + 2].fd < 0)
+               {
+                  fcntl(iFd, F_SETFL, O_NONBLOCK);
+                  sPoll[i + 2].fd = iFd;
+                  aUsed[i] = 0;
+                  iFd = -1;
+               }
+            if (iFd >= 0)
+               close(iFd);
+         }
+
+         for (i = 0 ; i < CTLCLIENTS ; i++)
+            if (sPoll[i + 2].fd >= 0 && sPoll[i + 2].revents)
+            {
+               iFd = sPoll[i + 2].fd;
+               iLength = read(iFd, aLine[i] + aUsed[i],
+                              LNSZ - 1 - aUsed[i]);
+               if (iLength > 0)
+               {
+                  aUsed[i] += iLength;
+                  aLine[i][aUsed[i]] = 0;
+
+                  // Each complete line is a command
+                  while ((pSz = strchr(aLine[i], '\n')))
+                  {
+                     *pSz = 0;
+                     if (pSz > aLine[i] && pSz[-1] == '\r')
+                        pSz[-1] = 0;
+                     ControlCommand(aLine[i],     szReply);
+                     send(iFd, szReply, strlen(szReply), MSG_NOSIGNAL);
+                     j = pSz + 1 - aLine[i];
+                     aUsed[i] -= j;
+                     memmove(aLine[i], pSz + 1, aUsed[i] + 1);
+                  }
+               }
+
+               // A line too long ends the client too
+               if (!iLength || (iLength < 0 && errno != EAGAIN
+                                && errno != EINTR)
+                   || aUsed[i] == LNSZ - 1)
+               {
+                  close(iFd);
+                  sPoll[i + 2].fd = -1;
+               }
+            }
+      }
+   }
+
+   for (i = 0 ; i < CTLCLIENTS ; i++)
+      if (sPoll[i + 2].fd >= 0)
+         close(sPoll[i + 2].fd);
+
+   return(pArg);
+}
+
+
+
+
+/*
+ *  TimedCopyFile
+ *
+ *  The files are opened relative to their iFdSourceDir and iFdDestDir
+ *  parent directories, see PathAt.  Their full names are only
+ *  displayed.
+ */
+
+int
+TimedCopyFile(const int iMode, int iFdSourceDir,
+              const char *szSourceFilename, int iFdDestDir,
+              const char *szDestFilename)
+{
+   int               i,
+                     iDiffer = 0,
+                     iErr = 0,
+                     iFallback = 0,
+                     iFdDest = -1,
+                     iFdDestRead = -1,
+                     iFdSource = -1,
+                     iExistDest,
+                     iExistSource,
+                     iSameMeta,
+                     iCachedDest = 0,
+                     iCachedSource = 0,
+                     iCloned = 0,
+                     iCreated = 0,
+                     iPart = 0,
+                     iPartKeep = 0,
+                     iPauseAfterVerif = 0,
+                     iPipe,
+                     iSkip = 0,
+                     iStreamChecked = 1,
+                     iTemp = 0;
+   TCHECKSUM         iDestChecksum = 0,
+                     iSourceChecksum = 0;
+   TCHKSTATE         sChecksum;
+   TPART             sPart;
+   ssize_t           iCopied = 0,
+                     iPause = 0;
+   off_t             iDiffOffset = 0,
+                     iOffset = 0;
+   char              sz2[LNSZ],
+                     szDest[LNSZ],
+                     szSource[LNSZ];
+   const char        *pSzDestName,
+                     *pSzSourceName,
+                     *pSzWriteName;
+   struct stat       sStatDest,
+                     sStatSource;
+   struct timespec   sTimes[2];
+
+
+   StringShortner(szSourceFilename, LNSZ - 80,     szSource);
+   StringShortner(szDestFilename, LNSZ - 80,     szDest);
+   pSzDestName = PathAt(iFdDestDir, szDestFilename);
+   pSzSourceName = PathAt(iFdSourceDir, szSourceFilename);
+   pSzWriteName = pSzDestName;
+
+   // Verify existing source and destination
+   iExistSource = FilenameExist(iFdSourceDir, szSourceFilename,
+                                                        &sStatSource);
+   if (!iExistSource)
+   {
+      iErr = ERROR_TCPY;
+      sprintf(gszErr, "File %s Not Found!", szSource);
+   }
+   iExistDest = FilenameExist(iFdDestDir, szDestFilename,     &sStatDest);
+   if (!iExistDest)
+   {
+      sStatDest.st_size = 0;
+#if defined(_WANT_FREEBSD11_STAT)
+      sStatDest.st_birthtim.tv_sec = 0;
+      sStatDest.st_birthtim.tv_nsec = 0;
+#endif
+      sStatDest.st_mtim.tv_sec = 0;
+      sStatDest.st_mtim.tv_nsec = 0;
+   }
+
+   // With the meta and sample checks, files with different
+   // modification times are copied without reading them first
+   iSameMeta = (sStatSource.st_size == sStatDest.st_size
+                && sStatSource.st_mtim.tv_sec == sStatDest.st_mtim.tv_sec
+                && sStatSource.st_mtim.tv_nsec == sStatDest.st_mtim.tv_nsec);
+
+   // A file done by the resumed run, and unchanged since, isn't read
+   if (!iErr && gpManifest && iExistDest && iSameMeta)
+   {
+      i = gpManifestIndex[ManifestFind(ManifestHash(MANIFESTFNV,
+                                                    szSourceFilename))];
+      iSkip = (i >= 0 && gpManifest[i].iSize == sStatSource.st_size
+               && gpManifest[i].iMtimeSec == sStatSource.st_mtim.tv_sec
+               && gpManifest[i].iMtimeNsec == sStatSource.st_mtim.tv_nsec);
+   }
+
+   if (!iErr && !iSkip && sStatSource.st_size && sStatDest.st_size
+       && sStatSource.st_size == sStatDest.st_size
+       && (giCheck == TCPY_CHECK_FULL || iSameMeta))
+   {
+      sprintf(sz2, "Verify %s to %s%s", szSource, szDest,
+                   giCheck == TCPY_CHECK_META ? " (meta)"
+                   : giCheck == TCPY_CHECK_SAMPLE ? " (sample)" : "");
+      EchoPrint(sz2);
+      if (!giTestRun && giCheck != TCPY_CHECK_META)
+      {
+         iErr = FilenameOpen(iFdSourceDir, szSourceFilename,     &iFdSource);
+         if (!iErr)
+            iErr = FilenameOpen(iFdDestDir, szDestFilename,     &iFdDestRead);
+      }
+      if (!iErr && !giTestRun)
+      {
+         if (giCheck == TCPY_CHECK_FULL)
+         {
+            // Only read the files without a cached checksum
+            iCachedSource = CacheGet(iFdSource, &sStatSource,
+                                                &iSourceChecksum);
+            iCachedDest = CacheGet(iFdDestRead, &sStatDest,
+                                                &iDestChecksum);
+            if (iCachedSource || iCachedDest)
+            {
+               if (!iCachedSource)
+                  iErr = FilenameChecksum(iFdSource, szSourceFilename, 0,
+                                                       &iSourceChecksum);
+               if (!iErr && !iCachedDest)
+                  iErr = FilenameChecksum(iFdDestRead, szDestFilename, 0,
+                                                       &iDestChecksum);
+               iDiffer = (iSourceChecksum != iDestChecksum);
+               iDiffOffset = -1;
+            }
+            else
+               iErr = FilenameCompare(iFdSource, iFdDestRead,
+                                      szSourceFilename, szDestFilename,
+                                      sStatSource.st_size,
+                                      &iSourceChecksum, &iDiffer, &iDiffOffset);
+         }
+         else if (giCheck == TCPY_CHECK_SAMPLE)
+            iErr = FilenameSample(iFdSource, iFdDestRead,
+                                  szSourceFilename, szDestFilename,
+                                  sStatSource.st_size,
+                                                   &iDiffer, &iDiffOffset);
+      }
+   }
+
+   if (!iErr && !iSkip && (sStatSource.st_size != sStatDest.st_size
+                 || sStatSource.st_mtim.tv_sec
+                    != sStatDest.st_mtim.tv_sec
+                 || sStatSource.st_mtim.tv_nsec
+                    != sStatDest.st_mtim.tv_nsec
+                 || iDiffer))
+   {
+      if (iExistDest)
+      {
+         // In the -atomic mode, the destination is replaced instead
+         sprintf(sz2, "%s %s (diff", giAtomic ? "Replace" : "Delete", szDest);
+         if (sStatSource.st_size != sStatDest.st_size)
+            sprintf(sz2+strlen(sz2), " %ld bytes",
+                    sStatDest.st_size - sStatSource.st_size);
+         if (sStatSource.st_mtim.tv_sec != sStatDest.st_mtim.tv_sec)
+            strcat(sz2, " sec");
+         if (sStatSource.st_mtim.tv_nsec != sStatDest.st_mtim.tv_nsec)
+            strcat(sz2, " nsec");
+         if (iDiffer && iDiffOffset >= 0)
+            sprintf(sz2+strlen(sz2), " chk@%lld", (long long)iDiffOffset);
+         else if (iDiffer)
+            strcat(sz2, " chk");
+         strcat(sz2, ")");
+         EchoPrint(sz2);
+         if (iFdDestRead >= 0)
+         {
+            close(iFdDestRead);
+            iFdDestRead = -1;
+         }
+         if (!giTestRun && !giAtomic)
+            if (unlinkat(iFdDestDir, pSzDestName, 0))
+            {
+               iErr = ERROR_TCPY;
+               sprintf(gszErr, "Could Not Delete %s (errno=%d)",
+                               szDest, errno);
+            }
+      }
+      if (!iErr)
+      {
+         // Copy Operation
+         iDestChecksum = 0;
+         if (giTestRun)
+         {
+            sprintf(sz2, "Copy %s to %s", szSource, szDest);
+            EchoPrint(sz2);
+         }
+         else
+         {
+            // The source may already be open from the verification
+            if (iFdSource >= 0)
+            {
+               if (lseek(iFdSource, 0, SEEK_SET) < 0)
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Seek in file %s Failed (errno=%d)",
+                                  szSource, errno);
+               }
+            }
+            else
+               iErr = FilenameOpen(iFdSourceDir, szSourceFilename,
+                                                            &iFdSource);
+            // With -resume, a large file is copied to a part file,
+            // renamed once verified.  Its journal lets an interrupted
+            // copy resume.
+            if (!iErr && giResume && sStatSource.st_size >= LNPARTMIN)
+               iErr = PartOpen(&sPart, iFdSource, iFdDestDir, pSzDestName,
+                               szDest, &sStatSource,     &iFdDest);
+            iPart = (iFdDest >= 0);
+            iTemp = iPart;
+
+            // In the -atomic mode, any file is copied to a part file,
+            // the destination staying readable until it's replaced.
+            // It's never written in place.
+            if (!iErr && !iPart && giAtomic
+                && PartName(pSzDestName, PARTSUFFIX,     sPart.szName))
+            {
+               iErr = ERROR_TCPY;
+               sprintf(gszErr, "Name %s Too Long for -atomic", szDest);
+            }
+            else if (!iErr && !iPart && giAtomic)
+            {
+               iTemp = 1;
+               iFdDest = openat(iFdDestDir, sPart.szName,
+                                O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+               if (iFdDest < 0)
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Could Not Create %s (errno=%d)",
+                                  szDest, errno);
+               }
+            }
+            if (iTemp)
+               pSzWriteName = sPart.szName;
+            if (!iErr && !iTemp)
+            {
+               iFdDest = openat(iFdDestDir, pSzDestName,
+                                O_WRONLY|O_CREAT|O_TRUNC,
+                                sStatSource.st_mode);
+               if (iFdDest < 0)
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Could Not Create %s (errno=%d)",
+                                  szDest, errno);
+               }
+            }
+            iCreated = (iFdDest >= 0);
+            if (!iErr)
+               BlockSizeInit(iFdDest);
+            if (!iErr && giReflink != TCPY_REFLINK_NEVER
+                && !(iPart && sPart.iOffset))
+               iErr = CopyClone(iFdSource, iFdDest, szDest,     &iCloned);
+
+            // The pipeline also replaces the read/write loop when the
+            // kernel can't copy, but a single block isn't worth it.  A
+            // part file is saved by the read/write loop only.
+            iPipe = ((giCopyEngine == TCPY_COPY_KERNEL
+                      || giCopyEngine == TCPY_COPY_PIPE)
+                     && sStatSource.st_size > LNPIPEBUFFER && !iPart);
+            if (!iErr)
+            {
+               if (iPart && sPart.iOffset)
+                  sprintf(sz2, "Resume %s to %s at %lld", szSource, szDest,
+                               (long long)sPart.iOffset);
+               else
+                  sprintf(sz2, "Copy %s to %s (%s)", szSource, szDest,
+                               iCloned ? "reflink"
+                               : iPart ? "read/write, resumable"
+                               : giCopyEngine == TCPY_COPY_KERNEL
+                                 ? "copy_file_range"
+                               : giCopyEngine == TCPY_COPY_URING
+                                 ? "io_uring"
+                               : iPipe ? "pipeline" : "read/write");
+               EchoPrint(sz2);
+            }
+            ChecksumInit(&sChecksum);
+            if (iPart)
+               sChecksum = sPart.sChecksum;
+            if (!iErr && !iCloned && iPart)
+               iErr = CopyReadWrite(iFdSource, iFdDest, szDest,
+                                                  &sChecksum, &sPart);
+            else if (!iErr && !iCloned && giCopyEngine == TCPY_COPY_KERNEL)
+            {
+               iErr = CopyKernel(iFdSource, iFdDest, sStatSource.st_size,
+                                 szDest,     &iCopied, &iFallback);
+               if (iCopied)
+                  iStreamChecked = 0;
+               if (!iErr && iFallback)
+               {
+                  sprintf(sz2, "Copy fallback to %s (errno=%d)",
+                               iPipe ? "pipeline" : "read/write", iFallback);
+                  EchoPrint(sz2);
+               }
+            }
+            else if (!iErr && !iCloned && giCopyEngine == TCPY_COPY_URING)
+            {
+               iErr = CopyUring(iFdSource, iFdDest, sStatSource.st_size,
+                                szDest,     &sChecksum, &iOffset, &iFallback);
+               if (!iErr && iFallback)
+               {
+                  sprintf(sz2, "Copy fallback to read/write (errno=%d)",
+                               iFallback);
+                  EchoPrint(sz2);
+               }
+
+               // The read/write loop continues after the last block
+               // copied in order, should the file size have changed
+               if (!iErr && (lseek(iFdSource, iOffset, SEEK_SET) < 0
+                             || lseek(iFdDest, iOffset, SEEK_SET) < 0))
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Seek in file %s Failed (errno=%d)",
+                                  szDest, errno);
+               }
+               if (!iErr)
+                  iErr = CopyReadWrite(iFdSource, iFdDest, szDest,
+                                                     &sChecksum, NULL);
+               if (!iErr && ftruncate(iFdDest, lseek(iFdDest, 0, SEEK_CUR)))
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Truncate of file %s Failed (errno=%d)",
+                                  szDest, errno);
+               }
+            }
+            if (!iErr && !iCloned && !iPart
+                && (giCopyEngine == TCPY_COPY_PIPE
+                    || giCopyEngine == TCPY_COPY_RW
+                    || (giCopyEngine == TCPY_COPY_KERNEL && iFallback)))
+            {
+               if (iPipe)
+                  iErr = CopyPipe(iFdSource, iFdDest, szSource, szDest,
+                                                           &sChecksum);
+               else
+                  iErr = CopyReadWrite(iFdSource, iFdDest, szDest,
+                                                     &sChecksum, NULL);
+            }
+            iDestChecksum = ChecksumValue(&sChecksum);
+
+            // An interrupted part file is kept for the next run, with
+            // its journal.  A complete one gets the mode of the source.
+            // It's made durable before replacing the destination.
+            if (iPart && iErr)
+               iPartKeep = 1;
+            else if (iTemp && !iErr
+                     && fchmod(iFdDest, sStatSource.st_mode & 07777))
+            {
+               iErr = ERROR_TCPY;
+               sprintf(gszErr, "Mode Set of %s Failed (errno=%d)",
+                               szDest, errno);
+            }
+            if (iPart && !iErr)
+               PartRemove(&sPart, iFdDest);
+            if (iTemp && !iErr && giAtomic && fdatasync(iFdDest))
+            {
+               iErr = ERROR_TCPY;
+               sprintf(gszErr, "Sync of %s Failed (errno=%d)",
+                               szDest, errno);
+            }
+            if (iFdDest >= 0)
+               close(iFdDest);
+
+            // Without a checksum of the copied bytes, the source has
+            // to be read again as the reference for the verification.
+            // A clone shares the source blocks, there's nothing to verify.
+            if (!iErr && !iCloned && !iStreamChecked && !iSourceChecksum)
+            {
+               sprintf(sz2, "Verify %s", szSource);
+               EchoPrint(sz2);
+               iErr = FilenameChecksum(iFdSource, szSourceFilename, 1,
+                                                       &iSourceChecksum);
+            }
+            if (!iErr && !iCloned && iStreamChecked)
+            {
+               if (iSourceChecksum)
+               {
+                  if (iSourceChecksum != iDestChecksum)
+                  {
+                     iErr = ERROR_TCPY;
+                     sprintf(gszErr, "Source %s Check Failed!", szSource);
+                  }
+               }
+               else
+                  iSourceChecksum = iDestChecksum;
+            }
+            // Only the file created by this copy is deleted, never the
+            // destination kept by the -atomic mode
+            if (iErr && !iPartKeep && iCreated)
+            {
+               iCreated = 0;
+               if (unlinkat(iFdDestDir, pSzWriteName, 0))
+                  printf("\nWARNING: Failed to delete %s (errno=%d)\n",
+                         szDest, errno);
+            }
+
+            // Adjust creation and modification times
+            if (!iErr)
+            {
+               sTimes[0].tv_sec = UTIME_OMIT;
+               sTimes[0].tv_nsec = UTIME_OMIT;
+#if defined(_WANT_FREEBSD11_STAT)
+               sTimes[1].tv_sec = sStatSource.st_birthtim.tv_sec;
+               sTimes[1].tv_nsec = sStatSource.st_birthtim.tv_nsec;
+               if (utimensat(iFdDestDir, pSzWriteName, sTimes, 0))
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Time Set of %s Failed!", szSource);
+               }
+#endif
+            }
+            if (!iErr)
+            {
+               sTimes[1].tv_sec = sStatSource.st_mtim.tv_sec;
+               sTimes[1].tv_nsec = sStatSource.st_mtim.tv_nsec;
+               if (utimensat(iFdDestDir, pSzWriteName, sTimes, 0))
+               {
+                  iErr = ERROR_TCPY;
+                  sprintf(gszErr, "Time Set of %s Failed!", szSource);
+               }
+            }
+         }
+      }
+
+      if (!iErr && !iCloned)
+      {
+         // Verify Destination Operation
+         sprintf(sz2, "Verify %s", szDest);
+         EchoPrint(sz2);
+         if (!giTestRun)
+         {
+            iErr = FilenameOpen(iFdDestDir, pSzWriteName,     &iFdDestRead);
+            if (!iErr)
+               iErr = FilenameChecksum(iFdDestRead, szDestFilename, 0,
+                                                       &iDestChecksum);
+            if (!iErr && iSourceChecksum != iDestChecksum)
+            {
+               iErr = ERROR_TCPY;
+               sprintf(gszErr, "Destination %s Check Failed!", szDest);
+               if (!iTemp && unlinkat(iFdDestDir, pSzDestName, 0))
+                  printf("\nWARNING: Failed to delete %s (errno=%d)\n",
+                         szDest, errno);
+            }
+         }
+      }
 
+      // The verified part file replaces the destination at once.  A
+      // part file failing after the copy is deleted.
+      if (!iErr && iTemp
+          && renameat(iFdDestDir, sPart.szName, iFdDestDir, pSzDestName))
+      {
+         iErr = ERROR_TCPY;
+         sprintf(gszErr, "Rename to %s Failed (errno=%d)", szDest, errno);
+      }
+      if (iErr && iTemp && iCreated && !iPartKeep
+          && unlinkat(iFdDestDir, sPart.szName, 0))
+         printf("\nWARNING: Failed to delete %s (errno=%d)\n",
+                szDest, errno);
 
-   *piChecksum = 0;
-   iFd = open(szFilename, O_RDONLY);
-   if (iFd < 0)
+      if (!iErr)
+      {
+         pthread_mutex_lock(&gsMutex);
+         if (iCloned)
+            giCloneFileCount++;
+         else
+            giCopyFileCount++;
+         pthread_mutex_unlock(&gsMutex);
+         if (!iCloned)
+         {
+            if (!iCachedSource)
+               CacheSet(iFdSource, iSourceChecksum);
+            CacheSet(iFdDestRead, iSourceChecksum);
+         }
+      }
+   }
+   else if (!iErr && iSourceChecksum && !giTestRun)
    {
-      iErr = ERROR_TCPY;
-      StringShortner(szFilename, LNSZ - 50,     sz);
-      sprintf(gszErr, "Could Not Open %s (errno=%d)", sz, errno);
+      // Both files are verified to be the same
+      if (!iCachedSource)
+         CacheSet(iFdSource, iSourceChecksum);
+      if (!iCachedDest)
+         CacheSet(iFdDestRead, iSourceChecksum);
+   }
+
+   if (iFdDestRead >= 0)
+      close(iFdDestRead);
+   if (iFdSource >= 0)
+      close(iFdSource);
+
+   if (!iErr && !iSkip && !giTestRun)
+      ManifestAdd(szSourceFilename, &sStatSource, iSourceChecksum);
+
+   if (!iErr && iMode == TCPY_MODE_DEL)
+   {
+      // Delete Source Operation
+      sprintf(sz2, "Delete %s", szSource);
+      EchoPrint(sz2);
+      if (!giTestRun)
+         if (unlinkat(iFdSourceDir, pSzSourceName, 0))
+         {
+            iErr = ERROR_TCPY;
+            sprintf(gszErr, "Failed to delete %s (errno=%d)",
+                            szDest, errno);
+         }
    }
+   
    if (!iErr)
    {
-      do
+      // A clone is a metadata operation, there's nothing to pace
+      *sz2 = 0;
+      pthread_mutex_lock(&gsMutex);
+      if (giPauseAfterVerif)
       {
-         iRead = read(iFd, gpBigBuffer, LNBIGBUFFER);
-         if (iRead > 0)
-            ChecksumAdd(gpBigBuffer, iRead, piChecksum);
+         // The pause is the rest of the period
+         giCopyByteCount = 0;
+         giDutyStart = NanoTime();
+         giDutyStatTime = 0;
+         giPauseAfterVerif = 0;
+         iPauseAfterVerif = 1;
+      }
+      pthread_mutex_unlock(&gsMutex);
 
-         iErr = KeyboardCheck(0);
+      // The throttle, when it has statistics, replaces the rests
+      if (!iPauseAfterVerif && !iCloned && !giFaster && !giThrottled
+          && giDutyWork < 100)
+         iPause = DutyRest(iFdDestDir);
+
+      pthread_mutex_lock(&gsMutex);
+      if (giTotalByteCount / 1073741824 > giGbDone)
+      {
+         giGbDone = (int)(giTotalByteCount / 1073741824);
+         sprintf(sz2, "%d Gb done.", giGbDone);
       }
-      while (iRead == LNBIGBUFFER && !iErr);
+      if (iPause)
+         sprintf(sz2 + strlen(sz2), "%s%d.%d sec. Pause...",
+                 *sz2 ? " " : "", (int)(iPause / ONESECINMICRO),
+                 (int)(iPause % ONESECINMICRO / 100000));
+      pthread_mutex_unlock(&gsMutex);
 
-      close(iFd);
+      if (iPauseAfterVerif)
+         iErr = KeyboardCheck(1);
+      if (*sz2)
+         EchoPrint(sz2);
+      if (iPause)
+         KeyboardRest(iPause);
    }
-   
-   return(iErr);                            
+
+   return(iErr);
 }
 
 
 
 
 /*
- *  FilenameExist
+ *  WalkDone
+ *
+ *  Account for the end of pTask, if any.  The first error stops the
+ *  walk, its message is kept for the main thread.
+ */
+
+void
+WalkDone(PTWALK pWalk, PTTASK pTask, int iErr)
+{
+   pthread_mutex_lock(&pWalk->sMutex);
+   if (pTask)
+   {
+      TaskFree(pTask);
+      pWalk->iPending--;
+   }
+   if (iErr && !pWalk->iErr)
+   {
+      pWalk->iErr = iErr;
+      strcpy(pWalk->szErr, gszErr);
+   }
+   if (!pWalk->iPending || pWalk->iErr)
+      pthread_cond_broadcast(&pWalk->sCond);
+   pthread_mutex_unlock(&pWalk->sMutex);
+}
+
+
+
+
+/*
+ *  WalkNext
+ *
+ *  Next task of the worker, or a task stolen from another worker.
+ *  Waits while other workers may still add tasks.  Returns NULL once
+ *  the walk is over.
+ */
+
+PTTASK
+WalkNext(PTWORKER pWorker)
+{
+   int      i,
+            iDone;
+   PTTASK   pTask;
+   PTWALK   pWalk = pWorker->pWalk;
+
+
+   do
+   {
+      pTask = WorkerPop(pWorker, 0);
+      for (i = 1 ; i < pWalk->iWorkerCount && !pTask ; i++)
+         pTask = WorkerPop(pWalk->pWorker
+                           + (pWorker->iIndex + i) % pWalk->iWorkerCount, 1);
+
+      pthread_mutex_lock(&pWalk->sMutex);
+      if (pTask)
+         pWalk->iQueued--;
+      else
+         while (pWalk->iQueued <= 0 && pWalk->iPending && !pWalk->iErr)
+            pthread_cond_wait(&pWalk->sCond, &pWalk->sMutex);
+      iDone = (!pWalk->iPending || pWalk->iErr);
+      if (pTask && pWalk->iErr)
+      {
+         TaskFree(pTask);
+         pWalk->iPending--;
+         pTask = NULL;
+      }
+      pthread_mutex_unlock(&pWalk->sMutex);
+   }
+   while (!pTask && !iDone);
+
+   return(pTask);
+}
+
+
+
+
+/*
+ *  WalkPush
+ *
+ *  Queue pTask on the deque of pWorker, pTask is freed on failure.
  */
 
 int
-FilenameExist(const char *szPathname,     struct stat *pStat)
+WalkPush(PTWORKER pWorker, PTTASK pTask)
 {
-   int i;
-   struct stat sStat, *pStat2;
+   int      iErr;
+   PTWALK   pWalk = pWorker->pWalk;
 
 
-   if (pStat)
-      pStat2 = pStat;
+   iErr = WorkerPush(pWorker, pTask);
+   if (iErr)
+      TaskFree(pTask);
    else
-      pStat2 = &sStat;
+   {
+      pthread_mutex_lock(&pWalk->sMutex);
+      pWalk->iPending++;
+      pWalk->iQueued++;
+      pthread_cond_signal(&pWalk->sCond);
+      pthread_mutex_unlock(&pWalk->sMutex);
+   }
 
-   i = !stat(szPathname,     pStat2);
-   if (i)
-      i = (pStat2->st_mode & S_IFREG);
+   return(iErr);
+}
+
+
+
+
+/*
+ *  WalkCopy
+ *
+ *  Copy the file of pTask once both of its devices have a free slot.
+ */
+
+int
+WalkCopy(PTWORKER pWorker, PTTASK pTask)
+{
+   int iErr;
+
+
+   DeviceAcquire(pTask->iDevSource, pTask->iDevDest);
+
+   // The user may have quit while this worker was waiting
+   iErr = KeyboardCheck(0);
+   if (!iErr)
+      iErr = TimedCopyFile(pWorker->pWalk->iMode,
+                           DirHandleFd(pTask->pSourceDir), pTask->szSource,
+                           DirHandleFd(pTask->pDestDir), pTask->szDest);
+
+   DeviceRelease(pTask->iDevSource, pTask->iDevDest);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  WalkDirectory
+ *
+ *  Read a directory of the parallel walk.  Its sub-directories are
+ *  created then queued, its files are queued for copy.  Once the deque
+ *  of the worker is long enough, the files are copied right away
+ *  instead, so that huge directories don't use too much memory.  The
+ *  directory is opened relative to its parent, then shared by the tasks
+ *  of its entries.  The files are copied from and to the devices of
+ *  their directories.
+ */
+
+int
+WalkDirectory(PTWORKER pWorker, PTTASK pTask)
+{
+   int            i,
+                  iErr = 0,
+                  iFd;
+   unsigned int   j;
+   char           sz[LNSZ];
+   const char     *pSz;
+   PTDIRENTRY     pEntry;
+   PTDIRHANDLE    pDest = NULL,
+                  pSource = NULL;
+   PTTASK         pTaskNew;
+   struct stat    sStat;
+   TDIRLIST       sList;
+   TNAMESET       sDirs,
+                  sNames,
+                  sStale;
+
+
+   memset(&sList, 0, sizeof(sList));
+   memset(&sDirs, 0, sizeof(sDirs));
+   memset(&sNames, 0, sizeof(sNames));
+   memset(&sStale, 0, sizeof(sStale));
+
+   // giSt_dev and giSt_ino are set before the walk starts
+   iFd = DirHandleFd(pTask->pSourceDir);
+   iFd = openat(iFd, PathAt(iFd, pTask->szSource), O_RDONLY|O_DIRECTORY);
+   if (iFd >= 0 && !fstat(iFd,     &sStat))
+   {
+      if (sStat.st_dev == giSt_dev && sStat.st_ino == giSt_ino)
+         iErr = ERROR_TCPY_CIRC;
+      pTask->iDevSource = sStat.st_dev;
+      pSource = DirHandleNew(iFd);
+      if (!pSource)
+         iErr = ERROR_TCPY_MEM;
+   }
+   else
+   {
+      if (iFd >= 0)
+         close(iFd);
+      iErr = ERROR_TCPY_USAGE;
+   }
+   if (!iErr)
+   {
+      iFd = DirHandleFd(pTask->pDestDir);
+      iFd = openat(iFd, PathAt(iFd, pTask->szDest), O_RDONLY|O_DIRECTORY);
+      if (iFd >= 0)
+      {
+         if (!fstat(iFd,     &sStat))
+            pTask->iDevDest = sStat.st_dev;
+         pDest = DirHandleNew(iFd);
+         if (!pDest)
+            iErr = ERROR_TCPY_MEM;
+      }
+      else
+      {
+         iErr = ERROR_TCPY;
+         StringShortner(pTask->szDest, LNSZ - 50,     sz);
+         sprintf(gszErr, "Could Not Open %s (errno=%d)", sz, errno);
+      }
+   }
+
+   if (!iErr)
+   {
+      iErr = DirListRead(&sList, pSource->iFd, pTask->szSource);
+      if (!iErr)
+      {
+         DirListClassify(&sList, pSource->iFd);
+         DirListSort(&sList, pSource->iFd);
+      }
+      for (j = 0 ; j < sList.iCount && !iErr ; j++)
+      {
+         pEntry = sList.pEntry + j;
+         pSz = sList.pArena + pEntry->iName;
+         if ((pEntry->iType & DT_DIR) == DT_DIR)
+         {
+            pTaskNew = TaskNew(TCPY_TASK_DIR, pSource, pDest,
+                               pTask->szSource, pTask->szDest, pSz);
+            if (!pTaskNew)
+               iErr = ERROR_TCPY_MEM;
+            if (!iErr)
+            {
+               iErr = DirectoryValidateAt(pDest->iFd, pTaskNew->szDest);
+               if (iErr)
+                  TaskFree(pTaskNew);
+            }
+            if (!iErr)
+               iErr = WalkPush(pWorker, pTaskNew);
+         }
+         else if ((pEntry->iType & DT_REG) == DT_REG)
+         {
+            pTaskNew = TaskNew(TCPY_TASK_FILE, pSource, pDest,
+                               pTask->szSource, pTask->szDest, pSz);
+            if (!pTaskNew)
+               iErr = ERROR_TCPY_MEM;
+            if (!iErr)
+            {
+               pTaskNew->iDevDest = pTask->iDevDest;
+               pTaskNew->iDevSource = pTask->iDevSource;
+               pthread_mutex_lock(&pWorker->sMutex);
+               i = pWorker->iCount;
+               pthread_mutex_unlock(&pWorker->sMutex);
+               if (i < TASKCOUNT)
+                  iErr = WalkPush(pWorker, pTaskNew);
+               else
+               {
+                  iErr = WalkCopy(pWorker, pTaskNew);
+                  TaskFree(pTaskNew);
+               }
+            }
+         }
+
+         // Any entry but a directory keeps the destination file of the
+         // same name
+         if (!iErr && pWorker->pWalk->iMode == TCPY_MODE_MIRROR)
+            iErr = NameSetAdd((pEntry->iType & DT_DIR) == DT_DIR
+                              ? &sDirs : &sNames,     pSz);
+      }
+
+      // Mirror cleanup, the stale directories are removed in parallel
+      if (!iErr && pWorker->pWalk->iMode == TCPY_MODE_MIRROR)
+         iErr = MirrorCleanup(&sNames, &sDirs, pDest->iFd, pTask->szDest,
+                                                           &sStale);
+      pSz = NULL;
+      while (!iErr && (pSz = NameSetNext(&sStale, pSz)))
+      {
+         pTaskNew = TaskNew(TCPY_TASK_PURGE, NULL, pDest, "",
+                            pTask->szDest, pSz);
+         if (pTaskNew)
+            iErr = WalkPush(pWorker, pTaskNew);
+         else
+            iErr = ERROR_TCPY_MEM;
+      }
+   }
+   DirHandleRelease(pDest);
+   DirHandleRelease(pSource);
+   DirListFree(&sList);
+   NameSetFree(&sDirs);
+   NameSetFree(&sNames);
+   NameSetFree(&sStale);
+
+   return(iErr);
+}
+
+
+
+
+/*
+ *  WalkThread
+ */
+
+void *
+WalkThread(void *pArg)
+{
+   int      iErr;
+   PTTASK   pTask = NULL;
+   PTWORKER pWorker = (PTWORKER)pArg;
+
+
+   gpBigBuffer = BigBufferAlloc();
+   if (gpBigBuffer)
+   {
+      do
+      {
+         pTask = WalkNext(pWorker);
+         if (pTask)
+         {
+            if (pTask->iType == TCPY_TASK_DIR)
+               iErr = WalkDirectory(pWorker, pTask);
+            else if (pTask->iType == TCPY_TASK_PURGE)
+               iErr = MirrorPurge(DirHandleFd(pTask->pDestDir),
+                                  pTask->szDest);
+            else
+               iErr = WalkCopy(pWorker, pTask);
+            WalkDone(pWorker->pWalk, pTask, iErr);
+         }
+      }
+      while (pTask);
+
+      free(gpBigBuffer);
+   }
+   else
+      WalkDone(pWorker->pWalk, NULL, ERROR_TCPY_MEM);
+
+   return(NULL);
+}
+
+
+
+
+/*
+ *  Walk
+ *
+ *  Copy the szSourceDir directory with giJobCount workers.  The
+ *  directories and the files are tasks on the deques of the workers,
+ *  an idle worker steals the tasks of the busy ones.
+ */
+
+int
+Walk(const int iMode, const char *szSourceDir, const char *szDestDir)
+{
+   int      i,
+            iErr = 0,
+            iStarted = 0;
+   PTTASK   pTask;
+   TWALK    sWalk;
+
+
+   memset(&sWalk, 0, sizeof(sWalk));
+   sWalk.iMode = iMode;
+   sWalk.iWorkerCount = giJobCount;
+   pthread_mutex_init(&sWalk.sMutex, NULL);
+   pthread_cond_init(&sWalk.sCond, NULL);
+   sWalk.pWorker = (PTWORKER)calloc(giJobCount, sizeof(TWORKER));
+   if (sWalk.pWorker)
+   {
+      for (i = 0 ; i < giJobCount ; i++)
+      {
+         sWalk.pWorker[i].iIndex = i;
+         sWalk.pWorker[i].pWalk = &sWalk;
+         pthread_mutex_init(&sWalk.pWorker[i].sMutex, NULL);
+      }
+
+      pTask = TaskNew(TCPY_TASK_DIR, NULL, NULL, szSourceDir, szDestDir, "");
+      if (pTask)
+         iErr = WalkPush(sWalk.pWorker,     pTask);
+      else
+         iErr = ERROR_TCPY_MEM;
+   }
+   else
+      iErr = ERROR_TCPY_MEM;
+
+   for (i = 0 ; i < giJobCount && !iErr ; i++)
+   {
+      iErr = pthread_create(&sWalk.pWorker[i].sThread, NULL, WalkThread,
+                            sWalk.pWorker + i);
+      if (iErr)
+      {
+         sprintf(gszErr, "Could Not Start The Copy Threads (errno=%d)",
+                         iErr);
+         iErr = ERROR_TCPY;
+         WalkDone(&sWalk, NULL, iErr);
+      }
+      else
+         iStarted++;
+   }
+   for (i = 0 ; i < iStarted ; i++)
+      pthread_join(sWalk.pWorker[i].sThread, NULL);
+
+   if (!iErr && sWalk.iErr)
+   {
+      iErr = sWalk.iErr;
+      strcpy(gszErr, sWalk.szErr);
+   }
 
-#ifdef TCPY_DEBUG
-   printf("\n%d = FilenameExist(%s), st_mode=0%o\n", i, szPathname, (unsigned int)(pStat2->st_mode));
-#endif // TCPY_DEBUG
+   if (sWalk.pWorker)
+   {
+      // Tasks left by a stopped walk
+      for (i = 0 ; i < giJobCount ; i++)
+      {
+         while ((pTask = WorkerPop(sWalk.pWorker + i, 0)))
+            TaskFree(pTask);
+         if (sWalk.pWorker[i].pTask)
+            free(sWalk.pWorker[i].pTask);
+         pthread_mutex_destroy(&sWalk.pWorker[i].sMutex);
+      }
+      free(sWalk.pWorker);
+   }
+   pthread_cond_destroy(&sWalk.sCond);
+   pthread_mutex_destroy(&sWalk.sMutex);
 
-   return(i);
+   return(iErr);
 }
 
 
 
 
-///////////////////////////////////////////////////////////////////////////
-//    Level 3 : Sub-systems                                              //
-///////////////////////////////////////////////////////////////////////////
-
 /*
- *  TimedCopyFile
+ *  TimedCopyDirectory
+ *
+ *  Copy the iFdSourceDir open directory into the iFdDestDir one, their
+ *  sub-directories being opened relative to them.  szSourceDir and
+ *  szDestDir, ending with a slash, are only displayed.
  */
 
 int
-TimedCopyFile(const int iMode, const char *szSourceFilename,
-              const char *szDestFilename)
+TimedCopyDirectory(const int iMode, int iFdSourceDir, int iFdDestDir,
+                   const char *szSourceDir, const char *szDestDir)
 {
-   int               iErr = 0,
-                     iFdDest = -1,
-                     iFdSource = -1,
-                     iExistDest,
-                     iExistSource;
-   unsigned long     iDestChecksum = 0,
-                     iSourceChecksum = 0;
-   ssize_t           iRead,
-                     iWrite;
-   TNSEC             iNano;
-   char              sz2[LNSZ],
-                     szDest[LNSZ],
-                     szSource[LNSZ];
-   struct stat       sStatDest,
-                     sStatSource;
-   struct timespec   sTimes[2];
-
+   int            iErr = 0,
+                  iFdDest,
+                  iFdSource;
+   unsigned int   j;
+   char           sz[LNSZ],
+                  *pSzFilenameDest = NULL,
+                  *pSzFilenameSource = NULL;
+   const char     *pSz;
+   PTDIRENTRY     pEntry;
+   struct stat    sStat;
+   TDIRLIST       sList;
+   TNAMESET       sDirs,
+                  sNames,
+                  sStale;
 
-   StringShortner(szSourceFilename, LNSZ - 80,     szSource);
-   StringShortner(szDestFilename, LNSZ - 80,     szDest);
 
-   // Verify existing source and destination
-   iExistSource = FilenameExist(szSourceFilename,     &sStatSource);
-   if (!iExistSource)
-   {
-      iErr = ERROR_TCPY;
-      sprintf(gszErr, "File %s Not Found!", szSource);
-   }
-   iExistDest = FilenameExist(szDestFilename,     &sStatDest);
-   if (!iExistDest)
-   {
-      sStatDest.st_size = 0;
-#if defined(_WANT_FREEBSD11_STAT)
-      sStatDest.st_birthtim.tv_sec = 0;
-      sStatDest.st_birthtim.tv_nsec = 0;
-#endif
-      sStatDest.st_mtim.tv_sec = 0;
-      sStatDest.st_mtim.tv_nsec = 0;
-   }
+   memset(&sList, 0, sizeof(sList));
+   memset(&sDirs, 0, sizeof(sDirs));
+   memset(&sNames, 0, sizeof(sNames));
+   memset(&sStale, 0, sizeof(sStale));
 
-   if (!iErr && sStatSource.st_size && sStatDest.st_size
-       && sStatSource.st_size == sStatDest.st_size)
-   {
-      sprintf(sz2, "Verify %s to %s", szSource, szDest);
-      EchoPrint(sz2);
-      if (!giTestRun)
-      {
-         iErr = FilenameChecksum(szSourceFilename,     &iSourceChecksum);
-         if (!iErr)
-            iErr = FilenameChecksum(szDestFilename,     &iDestChecksum);
-      }
-   }
+   pSzFilenameSource = (char *)malloc(strlen(szSourceDir) + LNSZ + 10);
+   pSzFilenameDest = (char *)malloc(strlen(szDestDir) + LNSZ + 10);
+   if (!(pSzFilenameSource && pSzFilenameDest))
+      iErr = ERROR_TCPY_MEM;
 
-   if (!iErr && (sStatSource.st_size != sStatDest.st_size
-                 || sStatSource.st_mtim.tv_sec
-                    != sStatDest.st_mtim.tv_sec
-                 || sStatSource.st_mtim.tv_nsec
-                    != sStatDest.st_mtim.tv_nsec
-                 || iSourceChecksum != iDestChecksum))
+   if (!iErr)
    {
-      if (iExistDest)
+      iErr = DirListRead(&sList, iFdSourceDir, szSourceDir);
+      if (!iErr)
       {
-         sprintf(sz2, "Delete %s (diff", szDest);
-         if (sStatSource.st_size != sStatDest.st_size)
-            sprintf(sz2+strlen(sz2), " %ld bytes",
-                    sStatDest.st_size - sStatSource.st_size);
-         if (sStatSource.st_mtim.tv_sec != sStatDest.st_mtim.tv_sec)
-            strcat(sz2, " sec");
-         if (sStatSource.st_mtim.tv_nsec != sStatDest.st_mtim.tv_nsec)
-            strcat(sz2, " nsec");
-         if (iSourceChecksum != iDestChecksum)
-            strcat(sz2, " chk");
-         strcat(sz2, ")");
-         EchoPrint(sz2);
-         if (!giTestRun)
-            if (unlink(szDestFilename))
-            {
-               iErr = ERROR_TCPY;
-               sprintf(gszErr, "Could Not Delete %s (errno=%d)",
-                               szDest, errno);
-            }
+         DirListClassify(&sList, iFdSourceDir);
+         DirListSort(&sList, iFdSourceDir);
       }
-      if (!iErr)
+      for (j = 0 ; j < sList.iCount && !iErr ; j++)
       {
-         // Copy Operation
-         sprintf(sz2, "Copy %s to %s", szSource, szDest);
-         EchoPrint(sz2);
-         iDestChecksum = 0;
-         if (!giTestRun)
+         pEntry = sList.pEntry + j;
+         pSz = sList.pArena + pEntry->iName;
+         strcpy(pSzFilenameSource, szSourceDir);
+         strcat(pSzFilenameSource, pSz);
+         strcpy(pSzFilenameDest, szDestDir);
+         strcat(pSzFilenameDest, pSz);
+         if ((pEntry->iType & DT_DIR) == DT_DIR)
          {
-            iFdSource = open(szSourceFilename, O_RDONLY);
-            if (iFdSource < 0)
-            {
-               iErr = ERROR_TCPY;
-               sprintf(gszErr, "Could Not Open %s (errno=%d)",
-                               szSource, errno);
-            }
+            strcat(pSzFilenameSource, "/");
+            strcat(pSzFilenameDest, "/");
+            iErr = DirectoryValidateAt(iFdDestDir, pSzFilenameDest);
             if (!iErr)
             {
-               iFdDest = open(szDestFilename, O_WRONLY|O_CREAT|O_TRUNC,
-                              sStatSource.st_mode);
-               if (iFdDest < 0)
-               {
-                  iErr = ERROR_TCPY;
-                  sprintf(gszErr, "Could Not Create %s (errno=%d)",
-                                  szDest, errno);
-               }
-            }
-            if (!iErr)
-               do
+               iFdSource = openat(iFdSourceDir, pSz, O_RDONLY|O_DIRECTORY);
+               if (iFdSource < 0 || fstat(iFdSource,     &sStat))
+                  iErr = ERROR_TCPY_USAGE;
+               else if (sStat.st_dev == giSt_dev && sStat.st_ino == giSt_ino)
+                  iErr = ERROR_TCPY_CIRC;
+               if (!iErr)
                {
-                  iRead = read(iFdSource, gpBigBuffer, LNBIGBUFFER);
-                  if (iRead > 0)
+                  iFdDest = openat(iFdDestDir, pSz, O_RDONLY|O_DIRECTORY);
+                  if (iFdDest < 0)
                   {
-                     giCopyByteCount += iRead;
-                     giTotalByteCount += iRead;
-
-                     // Slowdown for next write if needed
-                     iNano = giNanoPrev - giNanoFastest;
-                     if (iRead != LNBIGBUFFER)
-                        iNano = (iNano * iRead) / LNBIGBUFFER;
-                     sTimes[0].tv_sec = iNano / ONESECINNANO;
-                     sTimes[0].tv_nsec = iNano % ONESECINNANO;
-                     if (!giFaster)
-                        nanosleep(sTimes, NULL);
-
-                     ChecksumAdd(gpBigBuffer, iRead,     &iDestChecksum);
-
-                     iNano = NanoTime();
-                     iWrite = write(iFdDest, gpBigBuffer, iRead);
-                     giNanoPrev = NanoTime() - iNano;
-                     if (iRead != LNBIGBUFFER)
-                        giNanoPrev = (giNanoPrev * LNBIGBUFFER) / iRead;
-                     if (!giNanoFastest || giNanoPrev < giNanoFastest)
-                        giNanoFastest = giNanoPrev;
-
-                     if (iWrite != iRead)
-                     {
-                        iErr = ERROR_TCPY;
-                        sprintf(gszErr, "Write to file %s Failed (errno=%d)",
-                                        szDest, errno);
-                     }
+                     iErr = ERROR_TCPY;
+                     StringShortner(pSzFilenameDest, LNSZ - 50,     sz);
+                     sprintf(gszErr, "Could Not Open %s (errno=%d)", sz,
+                                     errno);
                   }
-                  if (!iErr)
-                     iErr = KeyboardCheck(0);
-               }
-               while (iRead == LNBIGBUFFER && !iErr);
-
-            if (iFdDest >= 0)
-               close(iFdDest);
-            if (iFdSource >= 0)
-               close(iFdSource);
-
-            if (!iErr)
-            {
-               if (iSourceChecksum)
-               {
-                  if (iSourceChecksum != iDestChecksum)
+                  else
                   {
-                     iErr = ERROR_TCPY;
-                     sprintf(gszErr, "Source %s Check Failed!", szSource);
+                     iErr = TimedCopyDirectory(iMode, iFdSource, iFdDest,
+                                               pSzFilenameSource,
+                                               pSzFilenameDest);
+                     close(iFdDest);
                   }
                }
-               else
-                  iSourceChecksum = iDestChecksum;
-            }
-            if (iErr)
-            {
-               if (unlink(szDestFilename))
-                  printf("\nWARNING: Failed to delete %s (errno=%d)\n",
-                         szDest, errno);
-            }
-
-            // Adjust creation and modification times
-            if (!iErr)
-            {
-               sTimes[0].tv_sec = UTIME_OMIT;
-               sTimes[0].tv_nsec = UTIME_OMIT;
-#if defined(_WANT_FREEBSD11_STAT)
-               sTimes[1].tv_sec = sStatSource.st_birthtim.tv_sec;
-               sTimes[1].tv_nsec = sStatSource.st_birthtim.tv_nsec;
-               if (utimensat(AT_FDCWD, szDestFilename, sTimes, 0))
-               {
-                  iErr = ERROR_TCPY;
-                  sprintf(gszErr, "Time Set of %s Failed!", szSource);
-               }
-#endif
-            }
-            if (!iErr)
-            {
-               sTimes[1].tv_sec = sStatSource.st_mtim.tv_sec;
-               sTimes[1].tv_nsec = sStatSource.st_mtim.tv_nsec;
-               if (utimensat(AT_FDCWD, szDestFilename, sTimes, 0))
-               {
-                  iErr = ERROR_TCPY;
-                  sprintf(gszErr, "Time Set of %s Failed!", szSource);
-               }
+               if (iFdSource >= 0)
+                  close(iFdSource);
             }
          }
+         else if ((pEntry->iType & DT_REG) == DT_REG)
+            iErr = TimedCopyFile(iMode, iFdSourceDir, pSzFilenameSource,
+                                        iFdDestDir, pSzFilenameDest);
+
+         // Any entry but a directory keeps the destination file of the
+         // same name
+         if (!iErr && iMode == TCPY_MODE_MIRROR)
+            iErr = NameSetAdd((pEntry->iType & DT_DIR) == DT_DIR
+                              ? &sDirs : &sNames,     pSz);
       }
 
-      if (!iErr)
+      // Mirror cleanup
+      if (!iErr && iMode == TCPY_MODE_MIRROR)
+         iErr = MirrorCleanup(&sNames, &sDirs, iFdDestDir, szDestDir,
+                                                           &sStale);
+      pSz = NULL;
+      while (!iErr && (pSz = NameSetNext(&sStale, pSz)))
       {
-         // Verify Destination Operation
-         sprintf(sz2, "Verify %s", szDest);
-         EchoPrint(sz2);
-         if (!giTestRun)
-         {
-            iErr = FilenameChecksum(szDestFilename,     &iDestChecksum);
-            if (!iErr && iSourceChecksum != iDestChecksum)
-            {
-               iErr = ERROR_TCPY;
-               sprintf(gszErr, "Destination %s Check Failed!", szDest);
-               if (unlink(szDestFilename))
-                  printf("\nWARNING: Failed to delete %s (errno=%d)\n",
-                         szDest, errno);
-            }
-         }
+         strcpy(pSzFilenameDest, szDestDir);
+         strcat(pSzFilenameDest, pSz);
+         strcat(pSzFilenameDest, "/");
+         iErr = MirrorPurge(iFdDestDir, pSzFilenameDest);
       }
    }
 
-   if (!iErr && iMode == TCPY_MODE_DEL)
-   {
-      // Delete Source Operation
-      sprintf(sz2, "Delete %s", szSource);
-      EchoPrint(sz2);
-      if (!giTestRun)
-         if (unlink(szSourceFilename))
-         {
-            iErr = ERROR_TCPY;
-            sprintf(gszErr, "Failed to delete %s (errno=%d)",
-                            szDest, errno);
-         }
-   }
-   
-   if (!iErr)
-   {
-      giFileCount++;
-      if (giPauseAfterVerif)
-      {
-         giCopyByteCount = 0;
-         giFileCount = 0;
-         giPauseAfterVerif = 0;
-         iErr = KeyboardCheck(1);
-      }
-      else if (giFileCount >= COPYCOUNT && !giFaster)
-      {
-         sprintf(sz2, "%d files done, 10 sec. Pause...", COPYCOUNT);
-         EchoPrint(sz2);
-         usleep(10000000);
-         giFileCount = 0;
-      }
-      else if (giCopyByteCount > 1073741824)
-      {
-         giCopyByteCount *= 30;
-         giCopyByteCount /= 1024;
-         if (giFaster)
-            sprintf(sz2, "%d Gb done.",
-                    (int)(giTotalByteCount/1073741824));
-         else
-            sprintf(sz2, "%d Gb done, %d sec. Pause...",
-                    (int)(giTotalByteCount/1073741824),
-                    (int)(giCopyByteCount/1000000));
-         EchoPrint(sz2);
-         if (!giFaster)
-            usleep(giCopyByteCount);
-         giCopyByteCount = 0;
-         giFileCount = 0;
-      }
-   }
+   DirListFree(&sList);
+   NameSetFree(&sDirs);
+   NameSetFree(&sNames);
+   NameSetFree(&sStale);
+   if (pSzFilenameDest)
+      free(pSzFilenameDest);
+   if (pSzFilenameSource)
+      free(pSzFilenameSource);
 
    return(iErr);
 }
@@ -781,13 +6975,12 @@ TimedCopy(const int iMode,
           const char *szDestDir,   const char *szDestFile)
 {
    int   i,
-         iErr = 0;
+         iErr = 0,
+         iFdDest,
+         iFdSource;
    char  sz[LNSZ],
-         sz2[LNSZ],
          *pSzFilenameDest = NULL,
          *pSzFilenameSource = NULL;
-   DIR   *pDir;
-   struct dirent  *pDirEntry;
    struct stat    sStat;
 
 
@@ -841,106 +7034,36 @@ TimedCopy(const int iMode,
                strcat(pSzFilenameSource, szSourceFile);
                strcpy(pSzFilenameDest, szDestDir);
                strcat(pSzFilenameDest, szDestFile);
-               iErr = TimedCopyFile(iMode, pSzFilenameSource,
-                                           pSzFilenameDest);
+               iErr = TimedCopyFile(iMode, AT_FDCWD, pSzFilenameSource,
+                                           AT_FDCWD, pSzFilenameDest);
             }
             else
             {
-               pDir = opendir(szSourceDir);
-               if (pDir)
-               {
-                  do
-                  {
-                     pDirEntry = readdir(pDir);
-                     if (pDirEntry)
-                     {
-                        if (strcmp(pDirEntry->d_name, ".")
-                            && strcmp(pDirEntry->d_name, ".."))
-                        {
-                           if (strlen(pDirEntry->d_name) > LNSZ)
-                           {
-                              iErr = ERROR_TCPY;
-                              StringShortner(pDirEntry->d_name, LNSZ - 40,
-                                                                        sz);
-                              sprintf(gszErr, "Name %s Too Long!", sz);
-                           }
-                           else if ((pDirEntry->d_type & DT_DIR) == DT_DIR)
-                           {
-                              strcpy(pSzFilenameSource, szSourceDir);
-                              strcat(pSzFilenameSource, pDirEntry->d_name);
-                              i = strlen(pSzFilenameSource);
-                              if (pSzFilenameSource[i - 1] != '/')
-                              {
-                                 pSzFilenameSource[i] = '/';
-                                 pSzFilenameSource[i + 1] = 0;
-                              }
-                              strcpy(pSzFilenameDest, szDestDir);
-                              strcat(pSzFilenameDest, pDirEntry->d_name);
-                              i = strlen(pSzFilenameDest);
-                              if (pSzFilenameDest[i - 1] != '/')
-                              {
-                                 pSzFilenameDest[i] = '/';
-                                 pSzFilenameDest[i + 1] = 0;
-                              }
-
-                              iErr = DirectoryValidate(pSzFilenameDest,
-                                                                     NULL);
-                              if (!iErr)
-                                 iErr = TimedCopy(iMode,
-                                                  pSzFilenameSource, "",
-                                                  pSzFilenameDest, "");
-                           }
-                           else if ((pDirEntry->d_type & DT_REG) == DT_REG)
-                           {
-                              strcpy(pSzFilenameSource, szSourceDir);
-                              strcat(pSzFilenameSource, pDirEntry->d_name);
-                              strcpy(pSzFilenameDest, szDestDir);
-                              strcat(pSzFilenameDest, pDirEntry->d_name);
-                              iErr = TimedCopyFile(iMode, pSzFilenameSource,
-                                                          pSzFilenameDest);
-                           }
-                        }
-                     }
-                  }
-                  while (pDirEntry && !iErr);
-
-                  closedir(pDir);
-               }
-
-               // Mirror cleanup
-               if (!iErr && iMode == TCPY_MODE_MIRROR && !(*szSourceFile))
+               // A tree is resumable from its manifest
+               iErr = ManifestOpen(szSourceDir, szDestDir);
+               if (!iErr && giJobCount > 1)
+                  iErr = Walk(iMode, szSourceDir, szDestDir);
+               else if (!iErr)
                {
-                  pDir = opendir(szDestDir);
-                  if (pDir)
+                  iFdSource = open(szSourceDir, O_RDONLY|O_DIRECTORY);
+                  iFdDest = open(szDestDir, O_RDONLY|O_DIRECTORY);
+                  if (iFdSource >= 0 && iFdDest >= 0)
+                     iErr = TimedCopyDirectory(iMode, iFdSource, iFdDest,
+                                               szSourceDir, szDestDir);
+                  else
                   {
-                     do
-                     {
-                        pDirEntry = readdir(pDir);
-                        if (pDirEntry)
-                           if ((pDirEntry->d_type & DT_REG) == DT_REG)
-                           {
-                              strcpy(pSzFilenameSource, szSourceDir);
-                              strcat(pSzFilenameSource, pDirEntry->d_name);
-                              strcpy(pSzFilenameDest, szDestDir);
-                              strcat(pSzFilenameDest, pDirEntry->d_name);
-                              if (!FilenameExist(pSzFilenameSource,   NULL))
-                              {
-                                 StringShortner(pSzFilenameDest, LNSZ - 30,
-                                                                        sz);
-                                 sprintf(sz2, "Delete %s", sz);
-                                 EchoPrint(sz2);
-                                 if (!giTestRun)
-                                    if (unlink(pSzFilenameDest))
-                                       printf("\nWARNING: Failed"
-                                              " to delete %s\n", sz);
-                              }
-                           }
-                     }
-                     while (pDirEntry);
-
-                     closedir(pDir);
+                     iErr = ERROR_TCPY;
+                     StringShortner(iFdSource < 0 ? szSourceDir : szDestDir,
+                                    LNSZ - 50,     sz);
+                     sprintf(gszErr, "Could Not Open %s (errno=%d)", sz,
+                                     errno);
                   }
+                  if (iFdDest >= 0)
+                     close(iFdDest);
+                  if (iFdSource >= 0)
+                     close(iFdSource);
                }
+               ManifestClose(!iErr);
             }
          }
       }
@@ -953,8 +7076,8 @@ TimedCopy(const int iMode,
             strcat(pSzFilenameSource, szSourceFile);
             strcpy(pSzFilenameDest, szDestDir);
             strcat(pSzFilenameDest, szDestFile);
-            iErr = TimedCopyFile(iMode, pSzFilenameSource,
-                                        pSzFilenameDest);
+            iErr = TimedCopyFile(iMode, AT_FDCWD, pSzFilenameSource,
+                                        AT_FDCWD, pSzFilenameDest);
          }
          else
          {
@@ -997,24 +7120,35 @@ main(int argc, char* argv[])
             iErr = 0,
             iLn = LNSZ,
             iMode = TCPY_MODE_COPY,
+            iControl = 0,
+            iKeyboard = 0,
             iOldStdinFlag,
             j;
+   long long iSize;
    tcflag_t iOldLocalMode;
+   pthread_t sControlThread,
+            sKeyboardThread;
+   sigset_t sSet;
    char     *pDestDir = NULL,
             *pDestFile = NULL,
             *pSourceDir = NULL,
             *pSourceFile = NULL,
             *pSz;
+   const char *pCtl = NULL;
+   struct rlimit  sLimit;
+   struct sigaction sAction;
    struct termios sTermios;
 
  
    *gszErr = 0;
+   ChecksumSelect("xxh64");
+   srandom(time(NULL) ^ getpid());
 
    // Switch the stdin line behavior to INSTANT, NoEcho
    //    Not all functions do what their doc pretends.  This is a big
-   //    mess just to have a simple non-blocking getchar() without
-   //    curses nor threads.  If this doesn't work as is on your
-   //    platform, at least you have a few hints to explore.
+   //    mess just to have the KeyboardThread read single keys without
+   //    curses.  If this doesn't work as is on your platform, at least
+   //    you have a few hints to explore.
    setvbuf(stdin, NULL, _IONBF, 0);
    i = iOldStdinFlag = fcntl(STDIN_FILENO, F_GETFL);
    i &= ~O_NONBLOCK;
@@ -1036,7 +7170,7 @@ main(int argc, char* argv[])
    iLn += 10;
 
    // Parse the command parameters
-   if (argc < 2 || argc > 6)
+   if (argc < 2)
       iErr = ERROR_TCPY_USAGE;
 
    for (i = 1 ; i < argc && !iErr ; i++)
@@ -1070,10 +7204,126 @@ main(int argc, char* argv[])
          giFaster = 1;
       else if (!strcmp(argv[i], "-t"))
          giTestRun = 1;
+      else if (!strcmp(argv[i], "-copy=kernel"))
+         giCopyEngine = TCPY_COPY_KERNEL;
+      else if (!strcmp(argv[i], "-copy=pipe"))
+         giCopyEngine = TCPY_COPY_PIPE;
+      else if (!strcmp(argv[i], "-copy=rw"))
+         giCopyEngine = TCPY_COPY_RW;
+      else if (!strcmp(argv[i], "-copy=uring"))
+         giCopyEngine = TCPY_COPY_URING;
+      else if (!strncmp(argv[i], "-qd=", 4))
+      {
+         giQueueDepth = atoi(argv[i] + 4);
+         if (giQueueDepth < 1 || giQueueDepth > QUEUEDEPTHMAX)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-j=", 3))
+      {
+         giJobCount = atoi(argv[i] + 3);
+         if (giJobCount < 1 || giJobCount > JOBCOUNTMAX)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strcmp(argv[i], "-bs=auto"))
+         giBlockAuto = 1;
+      else if (!strncmp(argv[i], "-bs=", 4))
+      {
+         giBlockAuto = 0;
+         giBlockSize = SizeParse(argv[i] + 4,     &pSz);
+         if (*pSz || giBlockSize < LNBLOCKMIN || giBlockSize > LNBLOCKMAX)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-bwlimit=", 9))
+      {
+         giBwLimit = SizeParse(argv[i] + 9,     &pSz);
+         giBwBurst = giBwLimit / 10;
+         if (giBwBurst < LNBIGBUFFER)
+            giBwBurst = LNBIGBUFFER;
+         if (*pSz == ':')
+            giBwBurst = SizeParse(pSz + 1,     &pSz);
+         if (*pSz || giBwLimit < 1 || giBwLimit > ONESECINNANO * 1024LL
+             || giBwBurst < 1)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-iops=", 6))
+      {
+         giIopsLimit = strtoll(argv[i] + 6, &pSz, 10);
+         if (*pSz || giIopsLimit < 1 || giIopsLimit > ONESECINNANO)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-duty=", 6))
+      {
+         // Work percent, then the period in seconds and/or bytes
+         giDutyWork = (int)strtol(argv[i] + 6, &pSz, 10);
+         while (*pSz == ':' && !iErr)
+         {
+            iSize = SizeParse(pSz + 1,     &pSz);
+            if (*pSz == 's' && iSize <= 86400)
+            {
+               giDutyNano = iSize * ONESECINNANO;
+               pSz++;
+            }
+            else
+               giDutyBytes = iSize;
+            if (iSize < 1)
+               iErr = ERROR_TCPY_USAGE;
+         }
+         if (*pSz || giDutyWork < 1 || giDutyWork > 100)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-ctl=", 5) && argv[i][5])
+         pCtl = argv[i] + 5;
+      else if (!strncmp(argv[i], "-latency=", 9))
+      {
+         giLatencyTarget = atoi(argv[i] + 9);
+         if (giLatencyTarget < 1 || giLatencyTarget > 60000)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-pressure=", 10))
+      {
+         giPressureTarget = atoi(argv[i] + 10);
+         if (giPressureTarget < 1 || giPressureTarget > 100)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strcmp(argv[i], "-resume"))
+         giResume = 1;
+      else if (!strcmp(argv[i], "-atomic"))
+         giAtomic = 1;
+      else if (!strcmp(argv[i], "-reflink=auto"))
+         giReflink = TCPY_REFLINK_AUTO;
+      else if (!strcmp(argv[i], "-reflink=always"))
+         giReflink = TCPY_REFLINK_ALWAYS;
+      else if (!strcmp(argv[i], "-reflink=never"))
+         giReflink = TCPY_REFLINK_NEVER;
+      else if (!strcmp(argv[i], "-cache=on"))
+         giCache = 1;
+      else if (!strcmp(argv[i], "-cache=off"))
+         giCache = 0;
+      else if (!strcmp(argv[i], "-check=full"))
+         giCheck = TCPY_CHECK_FULL;
+      else if (!strcmp(argv[i], "-check=meta"))
+         giCheck = TCPY_CHECK_META;
+      else if (!strncmp(argv[i], "-check=sample", 13))
+      {
+         giCheck = TCPY_CHECK_SAMPLE;
+         if (argv[i][13] == ':')
+            giSampleCount = atoi(argv[i] + 14);
+         else if (argv[i][13])
+            iErr = ERROR_TCPY_USAGE;
+         if (giSampleCount < 0)
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (!strncmp(argv[i], "-hash=", 6))
+      {
+         if (!ChecksumSelect(argv[i] + 6))
+            iErr = ERROR_TCPY_USAGE;
+      }
+      else if (pDestDir)
+         iErr = ERROR_TCPY_USAGE;
       else if (pSourceDir)
       {
          // Destination parameter
-         if (FilenameExist(argv[i],     NULL))
+         if (FilenameExist(AT_FDCWD, argv[i],     NULL))
          {
             if (*pSourceFile)
             {
@@ -1177,7 +7427,7 @@ main(int argc, char* argv[])
       else
       {
          // Source parameter (must exist)
-         if (FilenameExist(argv[i],     NULL))
+         if (FilenameExist(AT_FDCWD, argv[i],     NULL))
          {
             pSourceDir = (char *)malloc(iLn);
             pSourceFile = (char *)malloc(iLn);
@@ -1240,6 +7490,15 @@ main(int argc, char* argv[])
       }
       else
          iErr = ERROR_TCPY_USAGE;
+
+      // A throttle target or a rate limit replaces the adaptive pacing,
+      // even in faster mode
+      if (giLatencyTarget || giPressureTarget)
+         giPacing = TCPY_PACING_THROTTLE;
+      else if (giBwLimit || giIopsLimit)
+         giPacing = TCPY_PACING_BUCKET;
+      else if (giFaster)
+         giPacing = TCPY_PACING_OFF;
    }
    if (!iErr)
    {
@@ -1264,21 +7523,67 @@ main(int argc, char* argv[])
       // keep the same filename
       if (*pSourceFile && !(*pDestFile))
          strcpy(pDestFile, pSourceFile);
+
+      // Each directory being copied holds its descriptors open
+      if (!getrlimit(RLIMIT_NOFILE,     &sLimit)
+          && sLimit.rlim_cur < sLimit.rlim_max)
+      {
+         sLimit.rlim_cur = sLimit.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &sLimit);
+      }
       
-      gpBigBuffer = (char *)malloc(LNBIGBUFFER);
+      gpBigBuffer = BigBufferAlloc();
       if (!gpBigBuffer)
          iErr = ERROR_TCPY_MEM;
    }
+   if (!iErr && pCtl)
+      iErr = ControlOpen(pCtl);
    if (!iErr)
    {
       if (giTestRun)
          printf("\n*** TEST RUN ***\n");
 
+      // The keyboard and the signals have their own thread, the others
+      // block the signals
+      if (!pipe(giKeyboardPipe))
+      {
+         fcntl(giKeyboardPipe[1], F_SETFL, O_NONBLOCK);
+         memset(&sAction, 0, sizeof(sAction));
+         sAction.sa_handler = KeyboardSignal;
+         sAction.sa_flags = SA_RESTART;
+         sigaction(SIGUSR1, &sAction, NULL);
+         sigaction(SIGUSR2, &sAction, NULL);
+         sigemptyset(&sSet);
+         sigaddset(&sSet, SIGUSR1);
+         sigaddset(&sSet, SIGUSR2);
+         pthread_sigmask(SIG_BLOCK, &sSet, NULL);
+         iKeyboard = !pthread_create(&sKeyboardThread, NULL,
+                                     KeyboardThread, NULL);
+      }
+      if (pCtl)
+         iControl = !pthread_create(&sControlThread, NULL,
+                                    ControlThread, NULL);
+
+      giDutyStart = NanoTime();
       iErr = TimedCopy(iMode, pSourceDir, pSourceFile,
                               pDestDir,   pDestFile);
+      CacheClose();
+
+      if (iKeyboard && write(giKeyboardPipe[1], "", 1) == 1)
+         pthread_join(sKeyboardThread, NULL);
+      if (iControl && write(giControlPipe[1], "", 1) == 1)
+         pthread_join(sControlThread, NULL);
+   }
+   if (giControlFd >= 0)
+   {
+      close(giControlFd);
+      unlink(pCtl);
    }
 
    EchoPrint("");
+   if (giCopyFileCount || giCloneFileCount)
+      printf("%d files copied, %d files cloned\n", giCopyFileCount,
+                                                   giCloneFileCount);
    switch (iErr)
    {
       case 0:
@@ -1290,7 +7595,14 @@ main(int argc, char* argv[])
          break;
 
       case ERROR_TCPY_USAGE:
-         printf("USAGE: tcpy [-del|-mir] [-f] [-t]"
+         printf("USAGE: tcpy [-del|-mir] [-f] [-t] [-copy=kernel|pipe|uring|rw]"
+                " [-qd=N] [-bs=auto|N[k|m]] [-j=N]"
+                " [-bwlimit=N[k|m|g][:burst]] [-iops=N]"
+                " [-latency=N] [-pressure=N] [-duty=N[:Ts][:size]]"
+                " [-ctl=<socket>] [-resume] [-atomic]"
+                " [-reflink=auto|always|never]"
+                " [-hash=xxh64|crc32c|legacy]"
+                " [-check=full|meta|sample[:N]] [-cache=on|off]"
                 " <src-file>|<src-dir> [<dest-file>|<dest-dir>]\n");
          break;
 
@@ -1312,6 +7624,10 @@ main(int argc, char* argv[])
 
    if (gpBigBuffer)
       free(gpBigBuffer);
+   if (gpCache)
+      free(gpCache);
+   if (gpCacheIndex)
+      free(gpCacheIndex);
 
    if (pDestDir)
       free(pDestDir);